@@ -0,0 +1,426 @@
+/*
+
+ benchmark.cpp
+
+ measures the cost of one tick of the rainsensor pipeline, stage by
+ stage, for 1 up to 100000 sensors: the bucket and window update, the
+ rainfall computation, the text formatting, publishing into files and
+ shared memory, and the console output.
+
+ For every stage it prints the time, the heap allocations and the system
+ calls per operation, where an operation is one sensor in one tick.
+ Allocations are counted by replacing the global operator new. The reads
+ and writes are taken from /proc/self/io, and the opens, closes, renames
+ and truncations are counted by replacing those functions of the C
+ library. The last stage runs the update of rainsensor.cpp itself, with
+ the files of the sensors and windows, event log, history, counts,
+ checkpoint, shared memory and console. The exit code is 1 if such an
+ update allocates in steady state.
+
+ compile:
+
+ g++ -std=gnu++11 -O2 -pthread -DRAINSENSOR_NO_CPPGPIO -o benchmark benchmark.cpp -lrt
+
+ run:
+
+ ./benchmark [max sensors] [directory for the files]
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <sys/syscall.h>
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <memory>
+#include <atomic>
+#include <new>
+
+#include <dirent.h>
+
+#define RAINSENSOR_NO_MAIN
+#include "rainsensor.cpp"
+
+
+// count every heap allocation of the process. Not inlined, so that the
+// compiler does not pair our malloc() and free() with new and delete
+
+static std::atomic<unsigned long> allocations(0);
+
+__attribute__((noinline)) void* operator new(std::size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+
+// count the system calls that /proc/self/io leaves out. These
+// definitions take the place of the C library's for the calls of this
+// program, they make the system calls themselves
+
+static std::atomic<unsigned long> other_syscalls(0);
+
+extern "C" int open(const char* path, int flags, ...)
+{
+    other_syscalls.fetch_add(1, std::memory_order_relaxed);
+    mode_t mode = 0;
+    if (flags & O_CREAT) {
+        va_list args;
+        va_start(args, flags);
+        mode = static_cast<mode_t>(va_arg(args, int));
+        va_end(args);
+    }
+    return static_cast<int>(syscall(SYS_openat, AT_FDCWD, path, flags, mode));
+}
+
+extern "C" int close(int fd)
+{
+    other_syscalls.fetch_add(1, std::memory_order_relaxed);
+    return static_cast<int>(syscall(SYS_close, fd));
+}
+
+extern "C" int rename(const char* from, const char* to) noexcept
+{
+    other_syscalls.fetch_add(1, std::memory_order_relaxed);
+#ifdef SYS_renameat
+    return static_cast<int>(syscall(SYS_renameat, AT_FDCWD, from, AT_FDCWD, to));
+#else
+    return static_cast<int>(syscall(SYS_renameat2, AT_FDCWD, from, AT_FDCWD, to, 0));
+#endif
+}
+
+extern "C" int ftruncate(int fd, off_t length) noexcept
+{
+    other_syscalls.fetch_add(1, std::memory_order_relaxed);
+    return static_cast<int>(syscall(SYS_ftruncate, fd, length));
+}
+
+
+// the system calls of the process so far
+
+unsigned long syscalls()
+{
+    FILE* io = fopen("/proc/self/io", "r");
+    if (!io) return 0;
+    unsigned long value, total = 0;
+    char key[64];
+    while (fscanf(io, "%63[^:]: %lu\n", key, &value) == 2) {
+        if (!strcmp(key, "syscr") || !strcmp(key, "syscw")) total += value;
+    }
+    fclose(io);
+    return total + other_syscalls.load(std::memory_order_relaxed);
+}
+
+
+// a pulse source that costs next to nothing, so that the benchmark
+// measures the pipeline and not the pulse generator: every sensor sees a
+// pulse on every few reads
+
+class BenchmarkPulseSource : public PulseSource {
+public:
+    BenchmarkPulseSource(unsigned long every) : m_every(every ? every : 1) {}
+
+    virtual void start() { m_reads = 0; }
+    virtual unsigned long get_count() { return ++m_reads / m_every; }
+
+private:
+    unsigned long m_every;
+    unsigned long m_reads = 0;
+};
+
+
+// run a stage until it took a while and print its cost per operation
+
+class Stage {
+public:
+    Stage(std::size_t sensors) : m_sensors(sensors) {}
+
+    // returns the number of allocations after the warm up
+    template <typename Tick>
+    unsigned long run(const char* name, Tick tick, std::size_t sensors = 0)
+    {
+        if (!sensors) sensors = m_sensors;
+
+        // warm up: first touches of memory, file creation
+        tick();
+
+        // the cost of looking at the counters themselves
+        unsigned long syscalls_base = syscalls();
+        syscalls_base = syscalls() - syscalls_base;
+
+        unsigned long ticks = 0;
+        unsigned long allocations_start = allocations.load();
+        unsigned long syscalls_start = syscalls();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::duration elapsed;
+
+        do {
+            tick();
+            ++ticks;
+            elapsed = std::chrono::steady_clock::now() - start;
+        } while (elapsed < std::chrono::milliseconds(200) || ticks < 3);
+
+        unsigned long allocated = allocations.load() - allocations_start;
+        unsigned long called = syscalls() - syscalls_start - syscalls_base;
+
+        double ops = static_cast<double>(ticks) * sensors;
+        std::cout << std::left << std::setw(22) << name << std::right
+                  << std::setw(8) << sensors
+                  << std::setw(14) << std::setprecision(1) << std::fixed
+                  << std::chrono::duration<double, std::nano>(elapsed).count() / ops
+                  << std::setw(14) << std::setprecision(3) << allocated / ops
+                  << std::setw(14) << called / ops << std::endl;
+        return allocated;
+    }
+
+private:
+    std::size_t m_sensors;
+};
+
+
+// remove the files a stage left in the directory
+
+void remove_files(const std::string& directory, const std::string& prefix)
+{
+    DIR* dir = opendir(directory.c_str());
+    if (!dir) return;
+    while (struct dirent* entry = readdir(dir)) {
+        if (!strncmp(entry->d_name, prefix.c_str(), prefix.size())) unlink((directory + "/" + entry->d_name).c_str());
+    }
+    closedir(dir);
+}
+
+
+// the update of rainsensor with all outputs, on a virtual clock that moves
+// by an interval per update. Only the first hundred sensors have files.
+// Returns false if the updates allocate once warmed up
+
+bool steady_state(std::size_t count, const std::string& directory, Stage& stage)
+{
+    const std::string prefix = "rainsensor-benchmark-" + std::to_string(getpid()) + "-";
+
+    option_t options;
+    options.bucket_width = options.interval;
+    parse_windows("10m,24h,7d", options.windows);
+    parse_archives("1m:2d,10m:60d,1h:3650d", options.archives);
+    options.print_to_console = true;
+    options.history = true;
+    options.counts = true;
+    options.event_log = directory + "/" + prefix + "events";
+    options.checkpoint = directory + "/" + prefix + "checkpoint";
+    options.checkpoint_sync = 0;
+    options.shared_memory = "/" + prefix + "shm";
+
+    SensorSet sensors(options.bucket_width);
+    for (std::size_t i = 0; i < count; ++i) {
+        sensor_option_t sensor;
+        if (i < 100) sensor.filename = directory + "/" + prefix + std::to_string(i);
+        options.sensors.push_back(sensor);
+        sensors.add(sensor, std::unique_ptr<PulseSource>(new BenchmarkPulseSource(1 + i % 7)));
+    }
+    configure_windows(options, sensors);
+
+    outputs_t outputs;
+    open_outputs(options, sensors, outputs);
+    int null = open("/dev/null", O_WRONLY);
+    outputs.console.set_fd(null);
+
+    loop_t loop(options);
+    PulseCapture capture;
+    std::chrono::steady_clock::time_point now = loop.scheduler.deadline() - options.interval;
+    sensors.start(now + options.bucket_width);
+    restore_checkpoint(options, sensors, outputs);
+    for (std::size_t i = 0; i < sensors.size(); ++i) outputs.history_events.push_back(sensors.total_events(i));
+
+    // an hour of updates first: the tip windows span an hour and grow
+    // until they are full, so does the block of the event log
+    for (long i = 0; i < std::chrono::milliseconds(std::chrono::hours(1)).count() / options.interval.count(); ++i) {
+        now += options.interval;
+        update(options, sensors, outputs, loop, capture, now);
+    }
+
+    unsigned long allocated = stage.run("steady state update", [&]() {
+        now += options.interval;
+        update(options, sensors, outputs, loop, capture, now);
+    });
+
+    close(null);
+    shm_unlink(options.shared_memory.c_str());
+    remove_files(directory, prefix);
+
+    if (allocated) std::cout << "steady state update allocates " << allocated << " times" << std::endl;
+    return allocated == 0;
+}
+
+
+// returns false if the steady state of an update allocates
+
+bool benchmark(std::size_t count, const std::string& directory)
+{
+    // 5 minute intervals with the default buckets, and the usual windows
+    const std::chrono::milliseconds interval = std::chrono::minutes(5);
+
+    SensorSet sensors(interval);
+    sensor_option_t option;
+    for (std::size_t i = 0; i < count; ++i) {
+        sensors.add(option, std::unique_ptr<PulseSource>(new BenchmarkPulseSource(1 + i % 7)));
+    }
+
+    std::vector<window_spec_t> windows(3);
+    windows[0].length = 600000;
+    windows[1].length = 86400000;
+    windows[2].length = 604800000;
+    std::string error;
+    sensors.windows().configure(windows, static_cast<unsigned long>(interval.count()), sensors.size(), error);
+    sensors.start(std::chrono::steady_clock::time_point() + interval);
+
+    std::chrono::steady_clock::time_point now;
+
+    Stage stage(count);
+
+    stage.run("tick", [&]() {
+        now += interval;
+        sensors.tick(now);
+    });
+
+    stage.run("poll", [&]() {
+        sensors.poll(now);
+    });
+
+    stage.run("advance + windows", [&]() {
+        now += interval;
+        sensors.advance_to(now);
+    });
+
+    stage.run("mm/h", [&]() {
+        sensors.update_rates();
+    });
+
+    // text formatting the way the console output does it, into memory
+    std::ostringstream text;
+    stage.run("format iostream", [&]() {
+        text.str(std::string());
+        for (std::size_t i = 0; i < count; ++i) {
+            text << std::setprecision(2) << std::fixed << sensors.mm_per_hour(i) << " mm/m2" << std::endl;
+        }
+    });
+
+    // the same with the formatter of the updates
+    OutputBuffer buffer;
+    stage.run("format fixed", [&]() {
+        for (std::size_t i = 0; i < count; ++i) buffer.append_fixed(sensors.mm_per_hour(i), 2).append(" mm/m2\n");
+        buffer.clear();
+    });
+
+    // the console, or rather what it costs to write there line by line
+    std::ofstream console("/dev/null");
+    stage.run("console iostream", [&]() {
+        for (std::size_t i = 0; i < count; ++i) {
+            if (count > 1) console << "sensor " << i << ": ";
+            console << std::setprecision(2) << std::fixed << sensors.mm_per_hour(i) << " mm/m2" << std::endl;
+        }
+    });
+
+    // and collected into one write per tick, as rainsensor does
+    int null = open("/dev/null", O_WRONLY);
+    buffer.set_fd(null);
+    stage.run("console buffered", [&]() {
+        for (std::size_t i = 0; i < count; ++i) {
+            if (count > 1) buffer.append("sensor ").append(i).append(": ");
+            buffer.append_fixed(sensors.mm_per_hour(i), 2).append(" mm/m2\n");
+        }
+        buffer.flush();
+    });
+
+    // the files, at most a thousand of them
+    const std::size_t files = std::min<std::size_t>(count, 1000);
+    const char* method_names[] = { "publish truncate", "publish rename", "publish mmap" };
+    Publisher::method_t methods[] = { Publisher::TRUNCATE, Publisher::RENAME, Publisher::MMAP };
+
+    for (int m = 0; m < 3; ++m) {
+        std::vector<std::unique_ptr<Publisher> > publishers;
+        for (std::size_t i = 0; i < files; ++i) {
+            publishers.push_back(std::unique_ptr<Publisher>(new Publisher));
+            std::string filename = directory + "/rainsensor-benchmark-" + std::to_string(i);
+            if (!publishers.back()->open(filename, methods[m])) {
+                std::cerr << "Cannot open file " << filename << std::endl;
+                exit(1);
+            }
+        }
+
+        stage.run(method_names[m], [&]() {
+            for (std::size_t i = 0; i < files; ++i) publishers[i]->publish(sensors.mm_per_hour(i));
+        }, files);
+
+        for (std::size_t i = 0; i < files; ++i) {
+            std::string filename = publishers[i]->filename();
+            publishers[i].reset();
+            unlink(filename.c_str());
+            unlink((filename + ".tmp").c_str());
+        }
+    }
+
+    // the shared memory segment
+    std::string name = "/rainsensor-benchmark-" + std::to_string(getpid());
+    rainshm::Writer shm;
+    if (!shm.create(name, static_cast<uint32_t>(count), static_cast<uint32_t>(sensors.buckets_per_window()), static_cast<uint32_t>(interval.count()))) {
+        std::cerr << "Cannot create shared memory " << name << std::endl;
+        exit(1);
+    }
+
+    stage.run("shared memory", [&]() {
+        for (std::size_t i = 0; i < count; ++i) {
+            rainshm::snapshot_t values;
+            values.mm_per_hour = sensors.mm_per_hour(i);
+            values.total_events = sensors.total_events(i);
+            values.total_mm = sensors.rainfall(i, sensors.total_events(i));
+            values.last_tip = 0;
+            values.ring_position = static_cast<uint32_t>(sensors.current_bucket());
+            shm.update(i, values, sensors.bucket_row(0) + i, sensors.size(), sensors.buckets_started());
+        }
+    });
+
+    close(null);
+    shm_unlink(name.c_str());
+
+    return steady_state(count, directory, stage);
+}
+
+
+int main(int argc, char *argv[])
+{
+    std::size_t max_sensors = argc > 1 ? static_cast<std::size_t>(atol(argv[1])) : 100000;
+    std::string directory = argc > 2 ? argv[2] : "/tmp";
+
+    std::cout << std::left << std::setw(22) << "stage" << std::right
+              << std::setw(8) << "sensors"
+              << std::setw(14) << "ns/op"
+              << std::setw(14) << "allocs/op"
+              << std::setw(14) << "syscalls/op" << std::endl;
+
+    bool steady = true;
+    for (std::size_t count = 1; count <= max_sensors; count *= 10) {
+        if (!benchmark(count, directory)) steady = false;
+        std::cout << std::endl;
+    }
+
+    // non zero for scripts when the tick started to allocate
+    return steady ? 0 : 1;
+}
@@ -0,0 +1,297 @@
+/*
+
+ capture.hpp
+
+ reads the pulse sources in a thread of their own, so that a main loop
+ stalled in file I/O does not delay the timestamps of the pulses. The
+ capture thread polls every source at a fixed period and hands the new
+ pulses with the time it saw them to the main loop, through one lock free
+ single producer single consumer queue per source. The thread can be
+ pinned to a CPU.
+
+ When a queue is full the pulses stay with the capture thread and go out
+ with the next edge that fits, so no pulse is lost, only the time of
+ some of them gets coarser. The overflows are counted per source.
+
+ After a round that queued pulses the thread signals a descriptor, an
+ eventfd on Linux and a pipe elsewhere, so the main loop can sleep until
+ then instead of polling the queues.
+
+ */
+
+#ifndef RAINSENSOR_CAPTURE_HPP
+#define RAINSENSOR_CAPTURE_HPP
+
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include <stdint.h>
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#include "pulsesource.hpp"
+#include "spscqueue.hpp"
+
+
+// new pulses of a source and when the capture thread saw them
+
+struct edge_t {
+    std::chrono::steady_clock::time_point time;
+    unsigned long pulses = 0;
+};
+
+
+// the main loop's end of a captured source
+
+class QueuedPulseSource : public PulseSource {
+public:
+    QueuedPulseSource(std::size_t capacity, std::chrono::milliseconds period, int notify_fd = -1)
+    : m_queue(capacity), m_period(period), m_notify_fd(notify_fd) {}
+
+    // the capture thread starts the source it reads
+    virtual void start() {}
+
+    virtual unsigned long get_count()
+    {
+        edge_t edge;
+        while (m_queue.pop(edge)) {
+            m_count += edge.pulses;
+            m_last_edge = edge.time;
+        }
+        return m_count;
+    }
+
+    // when the capture thread saw the last pulse taken by get_count(), or
+    // when its source says it came
+    virtual bool last_pulse(std::chrono::steady_clock::time_point& when) const
+    {
+        if (!m_count) return false;
+        when = m_last_edge;
+        return true;
+    }
+
+    virtual std::chrono::steady_clock::time_point next_poll(std::chrono::steady_clock::time_point now)
+    {
+        return now + m_period;
+    }
+
+    // the descriptor of the capture, shared by all its sources
+    virtual int fd() const { return m_notify_fd; }
+
+    uint64_t overflows() const { return m_queue.overflows(); }
+
+    // those of the captured source, as of the capture thread's last round
+    virtual bool debounce_counts(uint64_t& accepted, uint64_t& rejected, std::chrono::microseconds& settle) const
+    {
+        if (!m_debounced.load(std::memory_order_acquire)) return false;
+        accepted = m_accepted.load(std::memory_order_relaxed);
+        rejected = m_rejected.load(std::memory_order_relaxed);
+        settle = std::chrono::microseconds(m_settle.load(std::memory_order_relaxed));
+        return true;
+    }
+
+private:
+    friend class PulseCapture;
+
+    // in the capture thread, after it read the source
+    void take_debounce_counts(const PulseSource& source)
+    {
+        uint64_t accepted, rejected;
+        std::chrono::microseconds settle;
+        if (!source.debounce_counts(accepted, rejected, settle)) return;
+        m_accepted.store(accepted, std::memory_order_relaxed);
+        m_rejected.store(rejected, std::memory_order_relaxed);
+        m_settle.store(settle.count(), std::memory_order_relaxed);
+        m_debounced.store(true, std::memory_order_release);
+    }
+
+    SPSCQueue<edge_t> m_queue;
+    std::chrono::milliseconds m_period;
+    int m_notify_fd;
+    unsigned long m_count = 0;
+    std::chrono::steady_clock::time_point m_last_edge;
+    std::atomic<bool> m_debounced{false};
+    std::atomic<uint64_t> m_accepted{0};
+    std::atomic<uint64_t> m_rejected{0};
+    std::atomic<int64_t> m_settle{0};
+};
+
+
+class PulseCapture {
+public:
+    // cpu < 0 leaves the thread where the scheduler puts it
+    PulseCapture(std::chrono::milliseconds period = std::chrono::milliseconds(1), int cpu = -1, std::size_t capacity = 256)
+    : m_period(period.count() > 0 ? period : std::chrono::milliseconds(1)), m_cpu(cpu), m_capacity(capacity)
+    {
+#ifdef __linux__
+        m_notify[0] = m_notify[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+        if (pipe(m_notify) == 0) {
+            fcntl(m_notify[0], F_SETFL, fcntl(m_notify[0], F_GETFL) | O_NONBLOCK);
+            fcntl(m_notify[1], F_SETFL, fcntl(m_notify[1], F_GETFL) | O_NONBLOCK);
+        }
+#endif
+    }
+
+    ~PulseCapture()
+    {
+        stop();
+        if (m_notify[0] >= 0) close(m_notify[0]);
+        if (m_notify[1] != m_notify[0]) close(m_notify[1]);
+    }
+
+    // take over a source, returns the one to hand to the SensorSet. Sources
+    // can only be added before start()
+    std::unique_ptr<PulseSource> add(std::unique_ptr<PulseSource> source)
+    {
+        source_t captured;
+        captured.source = std::move(source);
+        captured.queue = new QueuedPulseSource(m_capacity, m_period, m_notify[0]);
+        m_sources.push_back(std::move(captured));
+        return std::unique_ptr<PulseSource>(m_sources.back().queue);
+    }
+
+    std::size_t size() const { return m_sources.size(); }
+
+    // start the sources and the thread. Returns false if the thread could
+    // not be pinned, it runs anyway
+    bool start()
+    {
+        for (std::size_t i = 0; i < m_sources.size(); ++i) {
+            m_sources[i].source->start();
+            m_sources[i].last_count = m_sources[i].source->get_count();
+            m_sources[i].queue->take_debounce_counts(*m_sources[i].source);
+        }
+        m_running = true;
+        m_thread = std::thread(&PulseCapture::run, this);
+        return pin();
+    }
+
+    void stop()
+    {
+        m_running = false;
+        if (m_thread.joinable()) m_thread.join();
+    }
+
+    // the overflows of all queues, for the statistics
+    uint64_t overflows() const
+    {
+        uint64_t sum = 0;
+        for (std::size_t i = 0; i < m_sources.size(); ++i) sum += m_sources[i].queue->overflows();
+        return sum;
+    }
+
+    uint64_t overflows(std::size_t source) const { return m_sources[source].queue->overflows(); }
+
+    // readable after pulses were queued, -1 if it could not be created
+    int fd() const { return m_notify[0]; }
+
+    // take the signal before reading the queues, pulses queued after that
+    // signal again
+    void acknowledge()
+    {
+#ifdef __linux__
+        uint64_t value;
+        ssize_t rc = read(m_notify[0], &value, sizeof(value));
+#else
+        uint8_t values[64];
+        ssize_t rc;
+        while ((rc = read(m_notify[0], values, sizeof(values))) > 0) {}
+#endif
+        (void)rc;
+    }
+
+private:
+    PulseCapture(const PulseCapture&);
+    PulseCapture& operator=(const PulseCapture&);
+
+    struct source_t {
+        std::unique_ptr<PulseSource> source;
+        QueuedPulseSource* queue = nullptr; // owned by the SensorSet
+        unsigned long last_count = 0;
+        unsigned long pending = 0; // pulses that did not fit into the queue
+    };
+
+    bool pin()
+    {
+        if (m_cpu < 0) return true;
+#ifdef __linux__
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(m_cpu, &cpus);
+        return pthread_setaffinity_np(m_thread.native_handle(), sizeof(cpus), &cpus) == 0;
+#else
+        return false;
+#endif
+    }
+
+    void run()
+    {
+        std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+
+        while (m_running) {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            bool queued = false;
+
+            for (std::size_t i = 0; i < m_sources.size(); ++i) {
+                source_t& s = m_sources[i];
+                unsigned long count = s.source->get_count();
+                s.queue->take_debounce_counts(*s.source);
+                // counter overflow, like SensorSet::poll()
+                if (count < s.last_count) s.last_count = 0;
+                s.pending += count - s.last_count;
+                s.last_count = count;
+                if (!s.pending) continue;
+
+                edge_t edge;
+                edge.time = now;
+                s.source->last_pulse(edge.time);
+                edge.pulses = s.pending;
+                if (s.queue->m_queue.push(edge)) {
+                    s.pending = 0;
+                    queued = true;
+                }
+            }
+
+            if (queued) notify();
+
+            // a fixed rate, without catching up after a stall
+            next += m_period;
+            if (next < now) next = now + m_period;
+            std::this_thread::sleep_until(next);
+        }
+    }
+
+    void notify()
+    {
+#ifdef __linux__
+        uint64_t one = 1;
+        ssize_t rc = write(m_notify[1], &one, sizeof(one));
+#else
+        uint8_t one = 1;
+        ssize_t rc = write(m_notify[1], &one, sizeof(one));
+#endif
+        // a full pipe has signalled already
+        (void)rc;
+    }
+
+    std::chrono::milliseconds m_period;
+    int m_cpu;
+    std::size_t m_capacity;
+    std::vector<source_t> m_sources;
+    std::thread m_thread;
+    std::atomic<bool> m_running{false};
+    int m_notify[2] = {-1, -1}; // read and write end, the same eventfd on Linux
+};
+
+#endif
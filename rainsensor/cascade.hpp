@@ -0,0 +1,246 @@
+/*
+
+ cascade.hpp
+
+ several rolling windows of different length (say 10 minutes, 1 hour,
+ 24 hours and 7 days) for many sensors, all fed by a single push of the
+ closed interval buckets.
+
+ Every window is kept at a resolution that suits its length: a 7 day
+ window does not need 5 minute buckets. Windows of the same resolution
+ share a level, and every level accumulates its buckets from the finest
+ level whose resolution divides its own, so the levels form a cascade.
+ Memory per level is proportional to its longest window divided by its
+ resolution, and each window has its own running sums, so a push costs
+ O(levels) per sensor.
+
+ */
+
+#ifndef RAINSENSOR_CASCADE_HPP
+#define RAINSENSOR_CASCADE_HPP
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+
+// one configured window, lengths in any unit (rainsensor uses milliseconds).
+// resolution 0 picks a default
+
+struct window_spec_t {
+    std::string label;
+    unsigned long length = 0;
+    unsigned long resolution = 0;
+};
+
+
+class WindowCascade {
+public:
+    // the default resolution aims for this many buckets per window
+    static const unsigned long default_buckets = 24;
+
+    // set up the windows for pushed buckets of length base and the given
+    // number of columns (sensors). Returns false with a message for unusable
+    // windows
+    bool configure(const std::vector<window_spec_t>& specs, unsigned long base, std::size_t columns, std::string& error)
+    {
+        m_levels.clear();
+        m_windows.clear();
+        m_specs = specs;
+        m_base = base;
+        m_columns = columns;
+
+        for (std::vector<window_spec_t>::const_iterator it = specs.begin(); it != specs.end(); ++it) {
+            window_t window;
+            window.spec = *it;
+
+            if (!base || !it->length || it->length % base) {
+                error = "window " + it->label + " is not a multiple of the bucket width";
+                return false;
+            }
+            if (!window.spec.resolution) window.spec.resolution = default_resolution(it->length, base);
+            if (window.spec.resolution % base || it->length % window.spec.resolution) {
+                error = "window " + it->label + " does not fit its resolution";
+                return false;
+            }
+            window.buckets = it->length / window.spec.resolution;
+            m_windows.push_back(window);
+        }
+
+        // one level per distinct resolution, finest first
+        std::vector<unsigned long> resolutions;
+        for (std::size_t w = 0; w < m_windows.size(); ++w) resolutions.push_back(m_windows[w].spec.resolution);
+        std::sort(resolutions.begin(), resolutions.end());
+        resolutions.erase(std::unique(resolutions.begin(), resolutions.end()), resolutions.end());
+
+        for (std::size_t l = 0; l < resolutions.size(); ++l) {
+            level_t level;
+            level.resolution = resolutions[l];
+            level.source = no_source;
+            level.factor = resolutions[l] / base;
+            // feed from the finest level we can, the closest one to us
+            for (std::size_t s = l; s-- > 0;) {
+                if (resolutions[l] % resolutions[s] == 0) {
+                    level.source = s;
+                    level.factor = resolutions[l] / resolutions[s];
+                    break;
+                }
+            }
+            m_levels.push_back(level);
+        }
+
+        for (std::size_t w = 0; w < m_windows.size(); ++w) {
+            window_t& window = m_windows[w];
+            window.level = std::lower_bound(resolutions.begin(), resolutions.end(), window.spec.resolution) - resolutions.begin();
+            window.sums.assign(columns, 0);
+            level_t& level = m_levels[window.level];
+            level.rows = std::max(level.rows, window.buckets);
+            level.windows.push_back(w);
+        }
+
+        for (std::size_t l = 0; l < m_levels.size(); ++l) {
+            m_levels[l].ring.assign(m_levels[l].rows * columns, 0);
+            m_levels[l].accumulator.assign(columns, 0);
+        }
+
+        return true;
+    }
+
+    // push one closed base bucket of all columns
+    void push(const unsigned long* row)
+    {
+        for (std::size_t l = 0; l < m_levels.size(); ++l) {
+            level_t& level = m_levels[l];
+            level.closed = false;
+
+            const unsigned long* source = row;
+            if (level.source != no_source) {
+                const level_t& from = m_levels[level.source];
+                if (!from.closed) continue;
+                source = last_row(from);
+            }
+
+            for (std::size_t i = 0; i < m_columns; ++i) level.accumulator[i] += source[i];
+            if (++level.filled < level.factor) continue;
+
+            close(level);
+        }
+    }
+
+    // the configuration, to configure again with fresh state
+    const std::vector<window_spec_t>& specs() const { return m_specs; }
+    unsigned long base() const { return m_base; }
+
+    std::size_t windows() const { return m_windows.size(); }
+    const window_spec_t& spec(std::size_t window) const { return m_windows[window].spec; }
+
+    // the number of pulses within a window, for every column
+    const unsigned long* sums(std::size_t window) const { return m_windows[window].sums.empty() ? nullptr : &m_windows[window].sums[0]; }
+
+    // append the state of all levels and windows to a checkpoint
+    void save(std::vector<uint64_t>& out) const
+    {
+        for (std::size_t l = 0; l < m_levels.size(); ++l) {
+            const level_t& level = m_levels[l];
+            out.push_back(level.filled);
+            out.push_back(level.position);
+            out.insert(out.end(), level.accumulator.begin(), level.accumulator.end());
+            out.insert(out.end(), level.ring.begin(), level.ring.end());
+        }
+        for (std::size_t w = 0; w < m_windows.size(); ++w) {
+            out.insert(out.end(), m_windows[w].sums.begin(), m_windows[w].sums.end());
+        }
+    }
+
+    // restore a saved state of the same configuration, advances p
+    bool restore(const uint64_t*& p, const uint64_t* end)
+    {
+        for (std::size_t l = 0; l < m_levels.size(); ++l) {
+            level_t& level = m_levels[l];
+            if (static_cast<std::size_t>(end - p) < 2 + level.accumulator.size() + level.ring.size()) return false;
+            if (p[0] >= level.factor || p[1] >= level.rows) return false;
+            level.filled = static_cast<unsigned long>(*p++);
+            level.position = static_cast<std::size_t>(*p++);
+            std::copy(p, p + level.accumulator.size(), level.accumulator.begin());
+            p += level.accumulator.size();
+            std::copy(p, p + level.ring.size(), level.ring.begin());
+            p += level.ring.size();
+        }
+        for (std::size_t w = 0; w < m_windows.size(); ++w) {
+            std::vector<unsigned long>& sums = m_windows[w].sums;
+            if (static_cast<std::size_t>(end - p) < sums.size()) return false;
+            std::copy(p, p + sums.size(), sums.begin());
+            p += sums.size();
+        }
+        return true;
+    }
+
+private:
+    static const std::size_t no_source = static_cast<std::size_t>(-1);
+
+    struct level_t {
+        unsigned long resolution = 0;
+        std::size_t source = no_source; // level we accumulate from, or the pushed rows
+        unsigned long factor = 1;       // source buckets per bucket of this level
+        unsigned long filled = 0;       // source buckets accumulated so far
+        bool closed = false;            // closed a bucket during the current push
+        std::size_t rows = 0;
+        std::size_t position = 0;       // the ring row written next
+        std::vector<unsigned long> accumulator;
+        std::vector<unsigned long> ring;
+        std::vector<std::size_t> windows;
+    };
+
+    struct window_t {
+        window_spec_t spec;
+        std::size_t level = 0;
+        std::size_t buckets = 0;
+        std::vector<unsigned long> sums;
+    };
+
+    static unsigned long default_resolution(unsigned long length, unsigned long base)
+    {
+        // the coarsest resolution that still gives default_buckets buckets
+        // (or as many as possible), divides the window and is a multiple of base
+        unsigned long most = length / base;
+        unsigned long wanted = default_buckets;
+        for (unsigned long buckets = std::min(wanted, most); buckets < most; ++buckets) {
+            if (length % buckets == 0 && (length / buckets) % base == 0) return length / buckets;
+        }
+        return base;
+    }
+
+    const unsigned long* last_row(const level_t& level) const
+    {
+        std::size_t last = (level.position + level.rows - 1) % level.rows;
+        return &level.ring[last * m_columns];
+    }
+
+    void close(level_t& level)
+    {
+        unsigned long* slot = &level.ring[level.position * m_columns];
+
+        // the running sums: add the new bucket, drop the one that leaves the window
+        for (std::vector<std::size_t>::const_iterator it = level.windows.begin(); it != level.windows.end(); ++it) {
+            window_t& window = m_windows[*it];
+            const unsigned long* leaving = &level.ring[((level.position + level.rows - window.buckets) % level.rows) * m_columns];
+            for (std::size_t i = 0; i < m_columns; ++i) window.sums[i] += level.accumulator[i] - leaving[i];
+        }
+
+        std::copy(level.accumulator.begin(), level.accumulator.end(), slot);
+        std::fill(level.accumulator.begin(), level.accumulator.end(), 0);
+        if (++level.position == level.rows) level.position = 0;
+        level.filled = 0;
+        level.closed = true;
+    }
+
+    std::vector<window_spec_t> m_specs;
+    unsigned long m_base = 0;
+    std::size_t m_columns = 0;
+    std::vector<level_t> m_levels;
+    std::vector<window_t> m_windows;
+};
+
+#endif
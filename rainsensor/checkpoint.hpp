@@ -0,0 +1,185 @@
+/*
+
+ checkpoint.hpp
+
+ the state of all sensors in a memory mapped file, so that a restart
+ continues with the buckets and totals it had instead of starting from
+ zero.
+
+ The file holds two slots of equal size, and every save goes into the
+ slot that does not hold the latest state:
+
+   slot header (64 bytes): magic "RSCK", version, sequence number, number
+                           of words, layout key, crc32 over the header
+                           fields and the words
+   followed by the words of the state (uint64_t)
+
+ A save only writes to the mapping, which survives a crash of the process
+ without any system call. Against power loss the slot is synced to disk
+ every n-th save. Loading picks the valid slot with the higher sequence,
+ so a save torn by a power loss falls back to the one before it.
+
+ */
+
+#ifndef RAINSENSOR_CHECKPOINT_HPP
+#define RAINSENSOR_CHECKPOINT_HPP
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "eventlog.hpp"
+
+
+namespace checkpoint {
+
+const uint32_t magic = 0x4b435352; // "RSCK" in little endian
+const uint32_t version = 1;
+
+
+struct slot_header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t sequence;
+    uint64_t words;
+    uint32_t layout;        // identifies the configuration that wrote the state
+    uint32_t crc;           // over sequence, words, layout and the words
+    uint8_t reserved[32];
+};
+
+static_assert(sizeof(slot_header_t) == 64, "the slot header must fill exactly one cache line");
+
+
+class File {
+public:
+    File() {}
+    ~File() { close(); }
+
+    // map the checkpoint file for a state of words values. A file of another
+    // size is from another configuration and starts over empty. layout is a
+    // key of the configuration, a state saved under another key is not loaded
+    bool open(const std::string& filename, std::size_t words, uint32_t layout)
+    {
+        close();
+
+        int fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) return false;
+
+        long page = sysconf(_SC_PAGESIZE);
+        std::size_t align = page > 0 ? static_cast<std::size_t>(page) : 4096;
+        std::size_t slot = (sizeof(slot_header_t) + words * sizeof(uint64_t) + align - 1) / align * align;
+        std::size_t size = 2 * slot;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0
+            || (static_cast<std::size_t>(st.st_size) != size
+                && (ftruncate(fd, 0) != 0 || ftruncate(fd, static_cast<off_t>(size)) != 0))) {
+            ::close(fd);
+            return false;
+        }
+
+        void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (map == MAP_FAILED) return false;
+
+        m_base = static_cast<uint8_t*>(map);
+        m_size = size;
+        m_slot_size = slot;
+        m_words = words;
+        m_layout = layout;
+
+        // continue after the latest valid slot
+        m_latest = -1;
+        m_sequence = 0;
+        for (int s = 0; s < 2; ++s) {
+            if (valid(s) && (m_latest < 0 || header(s)->sequence > m_sequence)) {
+                m_latest = s;
+                m_sequence = header(s)->sequence;
+            }
+        }
+        return true;
+    }
+
+    bool is_open() const { return m_base != nullptr; }
+
+    // the latest saved state, returns false if there is none
+    bool load(std::vector<uint64_t>& state) const
+    {
+        if (m_latest < 0) return false;
+        const uint64_t* words = payload(m_latest);
+        state.assign(words, words + m_words);
+        return true;
+    }
+
+    // save a state of the size given to open(), and sync it to disk if
+    // sync is set. Returns false on a size mismatch or failed sync
+    bool save(const std::vector<uint64_t>& state, bool sync)
+    {
+        if (!m_base || state.size() != m_words) return false;
+
+        int s = m_latest == 0 ? 1 : 0;
+        slot_header_t* h = header(s);
+        // invalidate first, a torn slot must not pass as the latest one
+        h->magic = 0;
+        if (m_words) memcpy(payload(s), &state[0], m_words * sizeof(uint64_t));
+        h->version = version;
+        h->sequence = ++m_sequence;
+        h->words = m_words;
+        h->layout = m_layout;
+        h->crc = crc(s);
+        h->magic = magic;
+        m_latest = s;
+
+        if (!sync) return true;
+        return msync(m_base + s * m_slot_size, m_slot_size, MS_SYNC) == 0;
+    }
+
+    void close()
+    {
+        if (m_base) munmap(m_base, m_size);
+        m_base = nullptr;
+    }
+
+private:
+    File(const File&);
+    File& operator=(const File&);
+
+    slot_header_t* header(int slot) const { return reinterpret_cast<slot_header_t*>(m_base + slot * m_slot_size); }
+    uint64_t* payload(int slot) const { return reinterpret_cast<uint64_t*>(header(slot) + 1); }
+
+    uint32_t crc(int slot) const
+    {
+        const slot_header_t* h = header(slot);
+        uint32_t value = eventlog::CRC32::compute(reinterpret_cast<const uint8_t*>(&h->sequence), 20);
+        return eventlog::CRC32::compute(reinterpret_cast<const uint8_t*>(payload(slot)), m_words * sizeof(uint64_t), value);
+    }
+
+    bool valid(int slot) const
+    {
+        const slot_header_t* h = header(slot);
+        return h->magic == magic
+            && h->version == version
+            && h->words == m_words
+            && h->layout == m_layout
+            && h->crc == crc(slot);
+    }
+
+    uint8_t* m_base = nullptr;
+    std::size_t m_size = 0;
+    std::size_t m_slot_size = 0;
+    std::size_t m_words = 0;
+    uint32_t m_layout = 0;
+    int m_latest = -1;
+    uint64_t m_sequence = 0;
+};
+
+}
+
+#endif
@@ -0,0 +1,172 @@
+/*
+
+ clock.hpp
+
+ helpers for the two clocks the program deals with: the monotonic clock
+ that drives all timing, and the wall clock used in files and shared
+ memory that other programs read.
+
+ */
+
+#ifndef RAINSENSOR_CLOCK_HPP
+#define RAINSENSOR_CLOCK_HPP
+
+#include <stdint.h>
+
+#include <chrono>
+#include <ostream>
+
+
+// maps the monotonic clock onto microseconds since the epoch. The mapping
+// is taken once, so converted times never jump with clock adjustments
+
+class EpochMapping {
+public:
+    EpochMapping() { reset(); }
+
+    void reset()
+    {
+        m_steady_base = std::chrono::steady_clock::now();
+        m_epoch_base = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    int64_t operator()(std::chrono::steady_clock::time_point when) const
+    {
+        return m_epoch_base + std::chrono::duration_cast<std::chrono::microseconds>(when - m_steady_base).count();
+    }
+
+    // the monotonic time of the next wall clock multiple of period after
+    // now (e.g. the next full 5 minutes), so that all gauges - in this
+    // process or any other on a synchronized clock - sample together
+    std::chrono::steady_clock::time_point next_multiple(std::chrono::milliseconds period) const
+    {
+        const int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(period).count();
+        if (us <= 0) return std::chrono::steady_clock::now();
+        int64_t now = (*this)(std::chrono::steady_clock::now());
+        int64_t next = (now / us + 1) * us;
+        return m_steady_base + std::chrono::microseconds(next - m_epoch_base);
+    }
+
+private:
+    std::chrono::steady_clock::time_point m_steady_base;
+    int64_t m_epoch_base;
+};
+
+
+// a clock that only moves when told to, for the replay of recorded pulses.
+// Its time points are the wall clock times of the recording, so the
+// monotonic time of a replay is the time since the epoch
+
+class VirtualClock {
+public:
+    std::chrono::steady_clock::time_point now() const { return m_now; }
+    void set(std::chrono::steady_clock::time_point now) { m_now = now; }
+
+    static std::chrono::steady_clock::time_point from_epoch(int64_t us)
+    {
+        return std::chrono::steady_clock::time_point(std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::microseconds(us)));
+    }
+
+    static int64_t to_epoch(std::chrono::steady_clock::time_point when)
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(when.time_since_epoch()).count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point m_now;
+};
+
+
+// a histogram of wakeup lateness in power of two buckets of microseconds:
+// bucket 0 counts < 1us, bucket n counts [2^(n-1), 2^n) us
+
+class LatenessHistogram {
+public:
+    static const int bucket_count = 32;
+
+    LatenessHistogram() { reset(); }
+
+    void reset()
+    {
+        for (int i = 0; i < bucket_count; ++i) m_buckets[i] = 0;
+        m_count = m_missed = 0;
+        m_total = m_max = 0;
+    }
+
+    void add(std::chrono::steady_clock::duration lateness)
+    {
+        int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(lateness).count();
+        if (us < 0) us = 0;
+        int bucket = 0;
+        while (bucket < bucket_count - 1 && (int64_t(1) << bucket) <= us) ++bucket;
+        ++m_buckets[bucket];
+        ++m_count;
+        m_total += us;
+        if (us > m_max) m_max = us;
+    }
+
+    // deadlines that passed completely while we were not running
+    void add_missed(uint64_t count) { m_missed += count; }
+
+    uint64_t count() const { return m_count; }
+    uint64_t missed() const { return m_missed; }
+    int64_t max() const { return m_max; }
+    uint64_t bucket(int n) const { return m_buckets[n]; }
+
+    void print(std::ostream& out) const
+    {
+        out << "wakeup lateness: " << m_count << " wakeups, mean " << (m_count ? m_total / static_cast<int64_t>(m_count) : 0)
+            << "us, max " << m_max << "us, " << m_missed << " missed" << '\n';
+        for (int i = 0; i < bucket_count; ++i) {
+            if (!m_buckets[i]) continue;
+            out << "  < " << (int64_t(1) << i) << "us: " << m_buckets[i] << '\n';
+        }
+        out.flush();
+    }
+
+private:
+    uint64_t m_buckets[bucket_count];
+    uint64_t m_count;
+    uint64_t m_missed;
+    int64_t m_total;
+    int64_t m_max;
+};
+
+
+// absolute deadlines on the monotonic clock, aligned to wall clock
+// multiples of the interval. Waking up at the next deadline instead of
+// after the interval means that the time spent working does not add up:
+// the schedule never drifts. The monotonic clock is slewed by NTP, so
+// the alignment holds as long as the wall clock is not stepped
+
+class Scheduler {
+public:
+    Scheduler(std::chrono::milliseconds interval)
+    : m_interval(interval.count() > 0 ? interval : std::chrono::milliseconds(1))
+    , m_deadline(EpochMapping().next_multiple(std::chrono::duration_cast<std::chrono::milliseconds>(m_interval))) {}
+
+    std::chrono::steady_clock::time_point deadline() const { return m_deadline; }
+
+    // note that the deadline was reached at now and move on to the next one.
+    // Deadlines that passed completely (suspend, overload) are skipped
+    void arrived(std::chrono::steady_clock::time_point now)
+    {
+        m_lateness.add(now - m_deadline);
+        m_deadline += m_interval;
+        if (m_deadline <= now) {
+            uint64_t missed = static_cast<uint64_t>((now - m_deadline) / m_interval) + 1;
+            m_lateness.add_missed(missed);
+            m_deadline += static_cast<std::chrono::steady_clock::duration::rep>(missed) * m_interval;
+        }
+    }
+
+    const LatenessHistogram& lateness() const { return m_lateness; }
+    LatenessHistogram& lateness() { return m_lateness; }
+
+private:
+    std::chrono::steady_clock::duration m_interval;
+    std::chrono::steady_clock::time_point m_deadline;
+    LatenessHistogram m_lateness;
+};
+
+#endif
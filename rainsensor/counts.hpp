@@ -0,0 +1,316 @@
+/*
+
+ counts.hpp
+
+ the pulses of a sensor per interval, kept in a memory mapped file as a
+ Fenwick tree (binary indexed tree) instead of plain counts. The total of
+ any range of intervals is the difference of two prefix sums, O(log n)
+ whatever the length of the range, and a late or corrected interval is
+ patched in O(log n) as well.
+
+ The file is laid out as
+
+   header (64 bytes):  magic "RSPC", version, interval in milliseconds,
+                       start of interval 0 in milliseconds since the
+                       epoch, number of intervals, capacity, rainfall per
+                       pulse
+   tree:               uint64_t[capacity], node i (1 based) holds the
+                       pulses of the intervals (i - lowbit(i), i]
+
+ The file doubles its capacity when it is full, so it grows with the
+ intervals recorded.
+
+ */
+
+#ifndef RAINSENSOR_COUNTS_HPP
+#define RAINSENSOR_COUNTS_HPP
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdint.h>
+
+#include <string>
+#include <algorithm>
+
+
+// a Fenwick tree over an array it does not own, so that it can live in a
+// mapped file. Indices are 0 based, the nodes are 1 based internally
+
+template <typename T>
+class FenwickTree {
+public:
+    FenwickTree(T* nodes = nullptr, std::size_t size = 0) : m_nodes(nodes), m_size(size) {}
+
+    std::size_t size() const { return m_size; }
+
+    // add to the value at index, O(log n)
+    void add(std::size_t index, T delta)
+    {
+        for (std::size_t i = index + 1; i <= m_size; i += lowbit(i)) m_nodes[i - 1] += delta;
+    }
+
+    // the sum of the values at [0, end), O(log n)
+    T prefix(std::size_t end) const
+    {
+        T sum = T();
+        if (end > m_size) end = m_size;
+        for (std::size_t i = end; i > 0; i -= lowbit(i)) sum += m_nodes[i - 1];
+        return sum;
+    }
+
+    // the sum of the values at [begin, end)
+    T range(std::size_t begin, std::size_t end) const
+    {
+        return begin < end ? prefix(end) - prefix(begin) : T();
+    }
+
+    T at(std::size_t index) const { return range(index, index + 1); }
+
+    // append a value. The new node covers (n - lowbit(n), n], of which all
+    // but the new value are already in the tree: O(log n)
+    void push_back(T value)
+    {
+        std::size_t n = ++m_size;
+        m_nodes[n - 1] = value + prefix(n - 1) - prefix(n - lowbit(n));
+    }
+
+    void rebind(T* nodes) { m_nodes = nodes; }
+
+private:
+    static std::size_t lowbit(std::size_t i) { return i & (~i + 1); }
+
+    T* m_nodes;
+    std::size_t m_size;
+};
+
+
+namespace counts {
+
+const uint32_t magic = 0x43505352; // "RSPC" in little endian
+const uint32_t version = 1;
+
+
+struct header_t {
+    uint32_t magic;
+    uint32_t version;
+    int64_t interval;       // milliseconds
+    int64_t start;          // milliseconds since the epoch, valid with count > 0
+    uint64_t count;
+    uint64_t capacity;
+    double mm_per_pulse;
+    uint8_t reserved[16];
+};
+
+static_assert(sizeof(header_t) == 64, "the header must fill exactly one cache line");
+
+
+class File {
+public:
+    File() {}
+    ~File() { close(); }
+
+    // map a counts file, creating it for the given interval if it does not
+    // exist. Returns false if an existing file has another interval. A
+    // read only file takes the interval it has
+    bool open(const std::string& filename, int64_t interval, double mm_per_pulse, bool read_only = false)
+    {
+        close();
+
+        m_fd = ::open(filename.c_str(), read_only ? O_RDONLY : O_RDWR | O_CREAT, 0644);
+        if (m_fd < 0) return false;
+        m_read_only = read_only;
+
+        struct stat st;
+        if (fstat(m_fd, &st) != 0) {
+            close();
+            return false;
+        }
+
+        if (st.st_size == 0 && !read_only) {
+            if (!map(initial_capacity)) {
+                close();
+                return false;
+            }
+            header()->version = version;
+            header()->interval = interval;
+            header()->start = 0;
+            header()->count = 0;
+            header()->capacity = initial_capacity;
+            header()->magic = magic;
+        } else {
+            if (static_cast<std::size_t>(st.st_size) < sizeof(header_t) || !map_size(static_cast<std::size_t>(st.st_size))) {
+                close();
+                return false;
+            }
+            const header_t* h = header();
+            if (h->magic != magic || h->version != version || h->interval <= 0
+                || h->capacity > (m_size - sizeof(header_t)) / sizeof(uint64_t) || h->count > h->capacity
+                || (!read_only && h->interval != interval)) {
+                close();
+                return false;
+            }
+        }
+
+        if (!read_only) header()->mm_per_pulse = mm_per_pulse;
+        m_tree = FenwickTree<uint64_t>(nodes(), static_cast<std::size_t>(header()->count));
+        return true;
+    }
+
+    bool is_open() const { return m_base != nullptr; }
+
+    void close()
+    {
+        if (m_base) munmap(m_base, m_size);
+        m_base = nullptr;
+        if (m_fd >= 0) ::close(m_fd);
+        m_fd = -1;
+    }
+
+    // add pulses to the interval holding time (milliseconds since the
+    // epoch), late intervals included. Returns false for times before the
+    // first interval or if the file cannot grow
+    bool add(int64_t time, uint64_t pulses)
+    {
+        uint64_t index;
+        if (!slot(time, index)) return false;
+        m_tree.add(static_cast<std::size_t>(index), pulses);
+        return true;
+    }
+
+    // replace the pulses of the interval holding time, for corrections
+    bool set(int64_t time, uint64_t pulses)
+    {
+        uint64_t index;
+        if (!slot(time, index)) return false;
+        m_tree.add(static_cast<std::size_t>(index), pulses - m_tree.at(static_cast<std::size_t>(index)));
+        return true;
+    }
+
+    // the pulses of the intervals that start in [from, to)
+    uint64_t total(int64_t from, int64_t to) const
+    {
+        const header_t* h = header();
+        if (!h->count || to <= from) return 0;
+        return m_tree.range(index_of(from), index_of(to));
+    }
+
+    // the largest total within the windows of the given length that are
+    // aligned to multiples of it and overlap [from, to), like
+    // eventlog::IndexedLog::max_window(). O(log n) per window
+    uint64_t max_window(int64_t from, int64_t to, int64_t window, int64_t& window_start) const
+    {
+        uint64_t best = 0;
+        window_start = from;
+        if (window <= 0 || to <= from) return 0;
+
+        int64_t start = from - ((from % window) + window) % window;
+        for (; start < to; start += window) {
+            uint64_t sum = total(std::max(start, from), std::min(start + window, to));
+            if (sum > best) {
+                best = sum;
+                window_start = start;
+            }
+        }
+        return best;
+    }
+
+    int64_t interval() const { return header()->interval; }
+    int64_t start() const { return header()->start; }
+    uint64_t count() const { return header()->count; }
+    double mm_per_pulse() const { return header()->mm_per_pulse; }
+
+private:
+    File(const File&);
+    File& operator=(const File&);
+
+    static const uint64_t initial_capacity = 1024;
+
+    header_t* header() const { return reinterpret_cast<header_t*>(m_base); }
+    uint64_t* nodes() const { return reinterpret_cast<uint64_t*>(m_base + sizeof(header_t)); }
+
+    // the first interval that starts at or after time, clamped to the tree
+    std::size_t index_of(int64_t time) const
+    {
+        const header_t* h = header();
+        if (time <= h->start) return 0;
+        uint64_t index = static_cast<uint64_t>((time - h->start + h->interval - 1) / h->interval);
+        return static_cast<std::size_t>(index < h->count ? index : h->count);
+    }
+
+    // the interval holding time, appending empty intervals up to it
+    bool slot(int64_t time, uint64_t& index)
+    {
+        header_t* h = header();
+        if (m_read_only) return false;
+
+        if (!h->count) {
+            // the first interval aligned to the clock
+            h->start = time - ((time % h->interval) + h->interval) % h->interval;
+        }
+        if (time < h->start) return false;
+
+        index = static_cast<uint64_t>((time - h->start) / h->interval);
+        while (h->count <= index) {
+            if (h->count == h->capacity && !grow()) return false;
+            h = header();
+            m_tree.push_back(0);
+            h->count = m_tree.size();
+        }
+        return true;
+    }
+
+    // the file is extended before the header takes the new capacity, a
+    // crash in between leaves a file longer than its capacity, which
+    // open() accepts
+    bool grow()
+    {
+        uint64_t capacity = header()->capacity * 2;
+        std::size_t size = sizeof(header_t) + static_cast<std::size_t>(capacity) * sizeof(uint64_t);
+        uint8_t* old_base = m_base;
+        std::size_t old_size = m_size;
+        if (ftruncate(m_fd, static_cast<off_t>(size)) != 0) return false;
+
+        if (!map_size(size)) {
+            // keep the old mapping and, if we can, the old length, a
+            // longer file is accepted as well
+            m_base = old_base;
+            m_size = old_size;
+            int rc = ftruncate(m_fd, static_cast<off_t>(old_size));
+            (void)rc;
+            return false;
+        }
+        munmap(old_base, old_size);
+        header()->capacity = capacity;
+        m_tree.rebind(nodes());
+        return true;
+    }
+
+    bool map(uint64_t capacity)
+    {
+        std::size_t size = sizeof(header_t) + static_cast<std::size_t>(capacity) * sizeof(uint64_t);
+        if (ftruncate(m_fd, static_cast<off_t>(size)) != 0) return false;
+        return map_size(size);
+    }
+
+    bool map_size(std::size_t size)
+    {
+        void* map = mmap(nullptr, size, m_read_only ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+        if (map == MAP_FAILED) return false;
+        m_base = static_cast<uint8_t*>(map);
+        m_size = size;
+        return true;
+    }
+
+    int m_fd = -1;
+    bool m_read_only = false;
+    uint8_t* m_base = nullptr;
+    std::size_t m_size = 0;
+    FenwickTree<uint64_t> m_tree;
+};
+
+}
+
+#endif
@@ -0,0 +1,121 @@
+/*
+
+ curve.hpp
+
+ the volume of a tip as a function of the time since the previous tip.
+ A tipping bucket loses water while it tips, so in heavy rain every tip
+ carries more than its nominal volume. The curve is read from a text
+ file with one point per line, the time between tips in seconds and the
+ volume of a tip in milliliters, e.g.
+
+   # seconds  milliliter
+   2          5.8
+   10         5.3
+   60         5.0
+
+ The points are interpolated linearly into a dense table with one entry
+ per 100 milliseconds, so looking up a tip costs one division and one
+ load. Shorter times take the volume of the first point, longer times the
+ volume of the last one.
+
+ */
+
+#ifndef RAINSENSOR_CURVE_HPP
+#define RAINSENSOR_CURVE_HPP
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+
+#include "fixedpoint.hpp"
+
+
+class TipCurve {
+public:
+    // the spacing of the table
+    static const int64_t step_ms = 100;
+
+    // the times of the table are limited to a day, rain does not tip slower
+    static const int64_t max_ms = 86400000;
+
+    // read and compile a curve file, returns false and a message on errors
+    bool load(const std::string& filename, std::string& error)
+    {
+        std::ifstream in(filename.c_str());
+        if (!in.is_open()) {
+            error = "Cannot open file " + filename;
+            return false;
+        }
+
+        std::vector<std::pair<int64_t, uint64_t> > points; // milliseconds, microliters
+        std::string line;
+        int line_number = 0;
+        while (std::getline(in, line)) {
+            ++line_number;
+            std::string::size_type comment = line.find('#');
+            if (comment != std::string::npos) line.erase(comment);
+            std::istringstream fields(line);
+            std::string seconds, milliliter, rest;
+            if (!(fields >> seconds)) continue;
+
+            uint64_t ms, ul;
+            if (!(fields >> milliliter) || (fields >> rest)
+                || !fixedpoint::parse(seconds, 3, ms) || !fixedpoint::parse(milliliter, 3, ul)
+                || static_cast<int64_t>(ms) > max_ms || ul < 1 || ul > 1000000
+                || (!points.empty() && static_cast<int64_t>(ms) <= points.back().first)) {
+                std::ostringstream message;
+                message << "invalid point in " << filename << " line " << line_number << ": " << line;
+                error = message.str();
+                return false;
+            }
+            points.push_back(std::make_pair(static_cast<int64_t>(ms), ul));
+        }
+
+        if (points.empty()) {
+            error = "no points in " + filename;
+            return false;
+        }
+
+        compile(points);
+        return true;
+    }
+
+    // the volume of one tip in microliters, for the time since the one before
+    uint64_t microliters(std::chrono::steady_clock::duration interval) const
+    {
+        int64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(interval).count();
+        std::size_t index = ms > 0 ? static_cast<std::size_t>(ms / step_ms) : 0;
+        return m_table[index < m_table.size() ? index : m_table.size() - 1];
+    }
+
+    std::size_t size() const { return m_table.size(); }
+
+private:
+    void compile(const std::vector<std::pair<int64_t, uint64_t> >& points)
+    {
+        m_table.resize(static_cast<std::size_t>(points.back().first / step_ms) + 1);
+        std::size_t p = 0;
+        for (std::size_t i = 0; i < m_table.size(); ++i) {
+            int64_t ms = static_cast<int64_t>(i) * step_ms;
+            while (p < points.size() && points[p].first <= ms) ++p;
+            if (p == 0) m_table[i] = points.front().second;
+            else if (p == points.size()) m_table[i] = points.back().second;
+            else {
+                // between points p - 1 and p, rounded to the microliter
+                int64_t t0 = points[p - 1].first, t1 = points[p].first;
+                int64_t v0 = static_cast<int64_t>(points[p - 1].second), v1 = static_cast<int64_t>(points[p].second);
+                int64_t delta = (v1 - v0) * (ms - t0);
+                int64_t span = t1 - t0;
+                m_table[i] = static_cast<uint64_t>(v0 + (delta + (delta < 0 ? -span : span) / 2) / span);
+            }
+        }
+    }
+
+    std::vector<uint64_t> m_table;
+};
+
+#endif
@@ -0,0 +1,257 @@
+/*
+
+ debounce.hpp
+
+ debouncing of the raw edges of a reed contact with a settle time that
+ is learned from the bounces seen. A fixed debounce has to cover the
+ worst contact ever, 500 ms for GPIO::Counter, which caps a gauge at two
+ tips per second although its contact settles within a few
+ milliseconds. Here every edge within the settle time after an accepted
+ one is rejected. Rejected edges without a quiet gap since the accepted
+ one are bounces, and how long after the accepted edge they came is
+ remembered. The settle time follows the longest recent bounce times a
+ margin, within configured limits, so it shrinks on a clean contact and
+ grows again as soon as a contact bounces longer. A rejected edge after
+ a quiet gap is a tip lost to a settle time that is still too long, so
+ neither it nor its own bounces count.
+
+ The edges come from an EdgeSource. Besides the real ones this file has
+ a simulated contact that bounces, to try the debouncing on any box.
+
+ */
+
+#ifndef RAINSENSOR_DEBOUNCE_HPP
+#define RAINSENSOR_DEBOUNCE_HPP
+
+#include <stdint.h>
+
+#include <chrono>
+#include <random>
+#include <vector>
+#include <algorithm>
+#include <memory>
+
+#include "pulsesource.hpp"
+#include "edgelog.hpp"
+
+
+// the limits of the learned settle time
+
+struct debounce_t {
+    std::chrono::microseconds min_settle = std::chrono::milliseconds(2);
+    std::chrono::microseconds max_settle = std::chrono::milliseconds(500);
+    double margin = 2;  // settle time per longest bounce
+    std::chrono::microseconds max_gap = std::chrono::milliseconds(25); // between the edges of one bounce
+};
+
+
+class AdaptiveDebounce {
+public:
+    typedef std::chrono::steady_clock::time_point time_point_t;
+
+    // starts with the longest settle time until bounces were seen
+    AdaptiveDebounce(const debounce_t& config = debounce_t())
+    : m_config(config)
+    , m_bounce(std::chrono::duration_cast<std::chrono::microseconds>(config.max_settle / config.margin))
+    , m_settle(config.max_settle) {}
+
+    // an edge at time, in time order. Returns true if it is a new pulse
+    bool edge(time_point_t time)
+    {
+        time_point_t previous = m_previous;
+        m_previous = time;
+
+        if (m_accepted && time - m_last < m_settle) {
+            ++m_rejected;
+            // after a quiet gap the bounces of the accepted edge are over
+            if (time - previous > m_config.max_gap) m_bouncing = false;
+            if (m_bouncing) {
+                std::chrono::microseconds after = std::chrono::duration_cast<std::chrono::microseconds>(time - m_last);
+                if (after > m_tail) m_tail = after;
+            }
+            return false;
+        }
+
+        if (m_accepted) learn();
+        ++m_accepted;
+        m_last = time;
+        m_tail = std::chrono::microseconds::zero();
+        m_bouncing = true;
+        return true;
+    }
+
+    uint64_t accepted() const { return m_accepted; }
+    time_point_t last() const { return m_last; }
+    uint64_t rejected() const { return m_rejected; }
+    std::chrono::microseconds settle() const { return m_settle; }
+
+private:
+    // the bounces of the last pulse are complete: a longer one is taken at
+    // once, shorter ones only wear the estimate down by a quarter per pulse
+    void learn()
+    {
+        if (m_tail > m_bounce) m_bounce = m_tail;
+        else m_bounce -= (m_bounce - m_tail) / 4;
+
+        m_settle = std::chrono::duration_cast<std::chrono::microseconds>(m_bounce * m_config.margin);
+        if (m_settle < m_config.min_settle) m_settle = m_config.min_settle;
+        if (m_settle > m_config.max_settle) m_settle = m_config.max_settle;
+    }
+
+    debounce_t m_config;
+    std::chrono::microseconds m_bounce;     // the estimated longest bounce
+    std::chrono::microseconds m_settle;
+    std::chrono::microseconds m_tail = std::chrono::microseconds::zero(); // of the last pulse
+    time_point_t m_last;     // the last accepted edge
+    time_point_t m_previous; // and the last edge at all
+    bool m_bouncing = false; // no quiet gap since the last accepted edge
+    uint64_t m_accepted = 0;
+    uint64_t m_rejected = 0;
+};
+
+
+// the edges a fixed debouncing would accept if it takes an edge only
+// after the line was quiet for settle, given the gaps between the edges:
+// the gaps of at least that length. A plain loop over the array that the
+// compiler turns into vector compares, for sweeping many settle times
+// over a recording
+
+inline uint64_t count_quiet(const int64_t* gaps, std::size_t count, int64_t settle)
+{
+    uint64_t accepted = 0;
+    for (std::size_t i = 0; i < count; ++i) accepted += gaps[i] >= settle;
+    return accepted;
+}
+
+
+// the raw edges of a contact, the falling ones when it closes
+
+class EdgeSource {
+public:
+    virtual ~EdgeSource() {}
+
+    virtual void start() = 0;
+
+    // the next edge that happened until now, in time order. False if there
+    // is none (yet)
+    virtual bool next_edge(std::chrono::steady_clock::time_point& time) = 0;
+
+    virtual std::chrono::steady_clock::time_point next_poll(std::chrono::steady_clock::time_point now)
+    {
+        return now + std::chrono::milliseconds(10);
+    }
+
+    // readable when there are new edges, -1 if the source has to be polled
+    virtual int fd() const { return -1; }
+};
+
+
+// counts the edges of a source that pass the debouncing
+
+class DebouncedPulseSource : public PulseSource {
+public:
+    // with a recorder, all edges also go there as the given sensor
+    DebouncedPulseSource(std::unique_ptr<EdgeSource> edges, const debounce_t& config,
+                         edgelog::Writer* recorder = nullptr, uint32_t sensor = 0)
+    : m_edges(std::move(edges)), m_debounce(config), m_recorder(recorder), m_sensor(sensor) {}
+
+    virtual void start() { m_edges->start(); }
+
+    virtual unsigned long get_count()
+    {
+        std::chrono::steady_clock::time_point time;
+        while (m_edges->next_edge(time)) {
+            if (m_recorder) m_recorder->add(m_sensor, time);
+            if (m_debounce.edge(time)) ++m_count;
+        }
+        return m_count;
+    }
+
+    virtual std::chrono::steady_clock::time_point next_poll(std::chrono::steady_clock::time_point now)
+    {
+        return m_edges->next_poll(now);
+    }
+
+    virtual int fd() const { return m_edges->fd(); }
+
+    // the time of the edge, not of the poll that found it
+    virtual bool last_pulse(std::chrono::steady_clock::time_point& when) const
+    {
+        if (!m_debounce.accepted()) return false;
+        when = m_debounce.last();
+        return true;
+    }
+
+    virtual bool debounce_counts(uint64_t& accepted, uint64_t& rejected, std::chrono::microseconds& settle) const
+    {
+        accepted = m_debounce.accepted();
+        rejected = m_debounce.rejected();
+        settle = m_debounce.settle();
+        return true;
+    }
+
+private:
+    std::unique_ptr<EdgeSource> m_edges;
+    AdaptiveDebounce m_debounce;
+    edgelog::Writer* m_recorder;
+    uint32_t m_sensor;
+    unsigned long m_count = 0;
+};
+
+
+// the pulse train of the simulation with bouncing contacts: every pulse
+// is followed by a number of bounces spread over the bounce time
+
+class SimulatedEdgeSource : public EdgeSource {
+public:
+    SimulatedEdgeSource(const simulation_t& simulation)
+    : m_pulses(simulation)
+    , m_random(simulation.seed)
+    , m_bounces(simulation.bounces)
+    , m_bounce_time(simulation.bounce_time) {}
+
+    virtual void start()
+    {
+        m_pulses.start();
+        m_start = std::chrono::steady_clock::now();
+        m_pending.clear();
+    }
+
+    virtual bool next_edge(std::chrono::steady_clock::time_point& time)
+    {
+        double now = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+
+        // the bounces of a pulse may overlap the next pulse in a downpour
+        while (m_pulses.next_pulse_time() <= now) {
+            double pulse = m_pulses.next_pulse_time();
+            m_pending.push_back(pulse);
+            std::uniform_real_distribution<double> after(0, m_bounce_time);
+            for (unsigned int b = 0; b < m_bounces; ++b) m_pending.push_back(pulse + after(m_random));
+            m_pulses.count_until(pulse);
+            std::sort(m_pending.begin(), m_pending.end());
+        }
+
+        if (m_pending.empty() || m_pending.front() > now) return false;
+        time = m_start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(m_pending.front()));
+        m_pending.erase(m_pending.begin());
+        return true;
+    }
+
+    virtual std::chrono::steady_clock::time_point next_poll(std::chrono::steady_clock::time_point now)
+    {
+        if (!m_pending.empty()) {
+            return m_start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(m_pending.front()));
+        }
+        return m_pulses.next_poll(now);
+    }
+
+private:
+    SimulatedPulseSource m_pulses;
+    std::mt19937_64 m_random;
+    unsigned int m_bounces;
+    double m_bounce_time;
+    std::chrono::steady_clock::time_point m_start;
+    std::vector<double> m_pending; // seconds after start, sorted
+};
+
+#endif
@@ -0,0 +1,194 @@
+/*
+
+ edgelog.hpp
+
+ a recording of the raw, not yet debounced edges of the contacts, to see
+ what the lines really do and to choose the debouncing offline. Edges
+ come in bursts of bounces, so the file is kept as simple as possible
+ for fast appends and fast loads:
+
+   header (64 bytes):  magic "RSED", version, start of the recording in
+                       microseconds since the epoch
+   records:            uint64 each, the microseconds since the start
+                       shifted left by 16, or'ed with the sensor index
+
+ all little endian. 48 bits of microseconds last for almost nine years.
+ A run appends to an existing recording, a torn record at the end is
+ ignored.
+
+ */
+
+#ifndef RAINSENSOR_EDGELOG_HPP
+#define RAINSENSOR_EDGELOG_HPP
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <string>
+#include <vector>
+#include <chrono>
+
+#include "clock.hpp"
+#include "eventlog.hpp"
+
+
+namespace edgelog {
+
+const uint32_t magic = 0x44455352; // "RSED" in little endian
+const uint32_t version = 1;
+const std::size_t header_size = 64;
+const unsigned int sensor_bits = 16;
+const uint32_t max_sensors = 1 << sensor_bits;
+
+
+class Writer {
+public:
+    Writer() {}
+    ~Writer() { close(); }
+
+    // open a recording for appending, creating it if needed
+    bool open(const std::string& filename)
+    {
+        close();
+        m_fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (m_fd < 0) return false;
+
+        struct stat st;
+        if (fstat(m_fd, &st) != 0) {
+            close();
+            return false;
+        }
+
+        uint8_t header[header_size];
+        if (st.st_size == 0) {
+            memset(header, 0, sizeof(header));
+            m_start = m_epoch_time(std::chrono::steady_clock::now());
+            eventlog::put_u32(header, magic);
+            eventlog::put_u32(header + 4, version);
+            eventlog::put_u64(header + 8, static_cast<uint64_t>(m_start));
+            if (!write_all(header, sizeof(header))) {
+                close();
+                return false;
+            }
+        } else if (pread(m_fd, header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header))
+                   || eventlog::get_u32(header) != magic || eventlog::get_u32(header + 4) != version) {
+            close();
+            return false;
+        } else {
+            m_start = static_cast<int64_t>(eventlog::get_u64(header + 8));
+            // a torn record of the last run would shift all that follow
+            off_t torn = (st.st_size - static_cast<off_t>(header_size)) % 8;
+            if (torn && ftruncate(m_fd, st.st_size - torn) != 0) {
+                close();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool is_open() const { return m_fd >= 0; }
+
+    void close()
+    {
+        if (m_fd >= 0) {
+            flush();
+            ::close(m_fd);
+        }
+        m_fd = -1;
+        m_records.clear();
+    }
+
+    // record an edge, written out in batches
+    void add(uint32_t sensor, std::chrono::steady_clock::time_point when)
+    {
+        int64_t time = m_epoch_time(when) - m_start;
+        if (time < 0 || sensor >= max_sensors) return;
+        uint8_t record[8];
+        eventlog::put_u64(record, (static_cast<uint64_t>(time) << sensor_bits) | sensor);
+        m_records.insert(m_records.end(), record, record + sizeof(record));
+        if (m_records.size() >= batch) flush();
+    }
+
+    bool flush()
+    {
+        if (m_records.empty()) return true;
+        bool ok = write_all(&m_records[0], m_records.size());
+        m_records.clear();
+        return ok;
+    }
+
+private:
+    Writer(const Writer&);
+    Writer& operator=(const Writer&);
+
+    static const std::size_t batch = 64 * 1024;
+
+    bool write_all(const uint8_t* data, std::size_t size)
+    {
+        std::size_t written = 0;
+        while (written < size) {
+            ssize_t rc = ::write(m_fd, data + written, size - written);
+            if (rc < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            written += static_cast<std::size_t>(rc);
+        }
+        return true;
+    }
+
+    int m_fd = -1;
+    int64_t m_start = 0;
+    EpochMapping m_epoch_time;
+    std::vector<uint8_t> m_records;
+};
+
+
+// load a recording into one array of times per sensor, in microseconds
+// since the epoch. Returns false if the file is not a recording
+
+inline bool load(const std::string& filename, std::vector<std::vector<int64_t> >& times)
+{
+    times.clear();
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    uint8_t header[header_size];
+    if (::read(fd, header, sizeof(header)) != static_cast<ssize_t>(sizeof(header))
+        || eventlog::get_u32(header) != magic || eventlog::get_u32(header + 4) != version) {
+        ::close(fd);
+        return false;
+    }
+    int64_t start = static_cast<int64_t>(eventlog::get_u64(header + 8));
+
+    std::vector<uint8_t> buffer(1 << 16);
+    std::size_t filled = 0;
+    while (true) {
+        ssize_t rc = ::read(fd, &buffer[filled], buffer.size() - filled);
+        if (rc < 0 && errno == EINTR) continue;
+        if (rc <= 0) break;
+        filled += static_cast<std::size_t>(rc);
+
+        std::size_t used = filled - filled % 8;
+        for (std::size_t p = 0; p < used; p += 8) {
+            uint64_t record = eventlog::get_u64(&buffer[p]);
+            uint32_t sensor = static_cast<uint32_t>(record & (max_sensors - 1));
+            if (sensor >= times.size()) times.resize(sensor + 1);
+            times[sensor].push_back(start + static_cast<int64_t>(record >> sensor_bits));
+        }
+        memmove(&buffer[0], &buffer[used], filled - used);
+        filled -= used;
+    }
+
+    ::close(fd);
+    return true;
+}
+
+}
+
+#endif
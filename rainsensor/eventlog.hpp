@@ -0,0 +1,333 @@
+/*
+
+ eventlog.hpp
+
+ append-only binary log of every pulse, so that intensities can be
+ recomputed at any resolution later on.
+
+ The file is a sequence of self-contained blocks:
+
+   uint32  magic "RSLB"
+   uint32  payload size in bytes
+   uint32  number of entries
+   uint32  crc32 over the checkpoint and the payload
+   int64   checkpoint: time of the first entry, microseconds since the epoch
+   payload entries, each three varints:
+           sensor index, zigzag time delta to the previous entry in
+           microseconds, number of pulses
+
+ All integers are little endian. A typical entry takes 4 to 5 bytes, so a
+ year of tips of a busy gauge stays well below one megabyte. A block is
+ written with a single write(), and a torn block at the end of the file
+ (power loss) is detected by its crc and skipped by the reader.
+
+ */
+
+#ifndef RAINSENSOR_EVENTLOG_HPP
+#define RAINSENSOR_EVENTLOG_HPP
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <string>
+#include <vector>
+#include <chrono>
+
+#include "clock.hpp"
+
+
+namespace eventlog {
+
+const uint32_t block_magic = 0x424c5352; // "RSLB" in little endian
+const std::size_t header_size = 24;
+const std::size_t max_payload = 64 * 1024;
+// start a new block when the payload of the current one gets this large
+const std::size_t block_target = 4096;
+
+
+// the ubiquitous crc32 (polynomial 0xedb88320)
+
+class CRC32 {
+public:
+    static uint32_t compute(const uint8_t* data, std::size_t size, uint32_t crc = 0)
+    {
+        static const CRC32 instance;
+        crc = ~crc;
+        for (std::size_t i = 0; i < size; ++i) crc = instance.m_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+        return ~crc;
+    }
+
+private:
+    CRC32()
+    {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            m_table[i] = c;
+        }
+    }
+
+    uint32_t m_table[256];
+};
+
+
+inline void put_u32(uint8_t* p, uint32_t v)
+{
+    for (int i = 0; i < 4; ++i) p[i] = static_cast<uint8_t>(v >> (8 * i));
+}
+
+inline void put_u64(uint8_t* p, uint64_t v)
+{
+    for (int i = 0; i < 8; ++i) p[i] = static_cast<uint8_t>(v >> (8 * i));
+}
+
+inline uint32_t get_u32(const uint8_t* p)
+{
+    uint32_t v = 0;
+    for (int i = 3; i >= 0; --i) v = (v << 8) | p[i];
+    return v;
+}
+
+inline uint64_t get_u64(const uint8_t* p)
+{
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; --i) v = (v << 8) | p[i];
+    return v;
+}
+
+inline void put_varint(std::vector<uint8_t>& out, uint64_t v)
+{
+    while (v >= 0x80) {
+        out.push_back(static_cast<uint8_t>(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(v));
+}
+
+// returns false on a truncated or overlong varint
+inline bool get_varint(const uint8_t*& p, const uint8_t* end, uint64_t& v)
+{
+    v = 0;
+    for (int shift = 0; shift < 64 && p < end; shift += 7) {
+        uint8_t byte = *p++;
+        v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+inline uint64_t zigzag(int64_t v) { return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63); }
+inline int64_t unzigzag(uint64_t v) { return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1); }
+
+
+// one decoded log entry
+
+struct entry_t {
+    uint32_t sensor;
+    int64_t time;       // microseconds since the epoch
+    uint64_t pulses;
+};
+
+
+// check the block at p: magic, size and crc. Returns its payload size, or
+// -1 for a damaged or truncated block
+
+inline long check_block(const uint8_t* p, const uint8_t* end)
+{
+    if (end - p < static_cast<std::ptrdiff_t>(header_size)) return -1;
+    uint32_t payload = get_u32(p + 4);
+    if (get_u32(p) != block_magic
+        || payload > max_payload
+        || static_cast<std::size_t>(end - p) < header_size + payload
+        || CRC32::compute(p + 16, header_size - 16 + payload) != get_u32(p + 12)) return -1;
+    return static_cast<long>(payload);
+}
+
+// the next block magic at or after p, or end
+inline const uint8_t* resync(const uint8_t* p, const uint8_t* end)
+{
+    for (; end - p >= 4; ++p) {
+        if (get_u32(p) == block_magic) return p;
+    }
+    return end;
+}
+
+// decode the entries of a checked block, the callback gets every entry_t.
+// Returns the number of entries
+template <typename Callback>
+std::size_t decode_block(const uint8_t* p, Callback callback)
+{
+    std::size_t count = 0;
+    entry_t entry;
+    entry.time = static_cast<int64_t>(get_u64(p + 16));
+    const uint8_t* q = p + header_size;
+    const uint8_t* block_end = q + get_u32(p + 4);
+    for (uint32_t n = get_u32(p + 8); n > 0; --n) {
+        uint64_t sensor, delta;
+        if (!get_varint(q, block_end, sensor)
+            || !get_varint(q, block_end, delta)
+            || !get_varint(q, block_end, entry.pulses)) break;
+        entry.sensor = static_cast<uint32_t>(sensor);
+        entry.time += unzigzag(delta);
+        callback(entry);
+        ++count;
+    }
+    return count;
+}
+
+
+// the writer buffers entries and appends them block by block
+
+class Writer {
+public:
+    Writer() {}
+    ~Writer() { close(); }
+
+    bool open(const std::string& filename)
+    {
+        close();
+        m_fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        m_epoch_time.reset();
+        return m_fd >= 0;
+    }
+
+    bool is_open() const { return m_fd >= 0; }
+
+    // log pulses of a sensor. Returns false if a full block could not be written
+    bool add(uint32_t sensor, std::chrono::steady_clock::time_point when, uint64_t pulses)
+    {
+        return add_epoch(sensor, m_epoch_time(when), pulses);
+    }
+
+    bool add_epoch(uint32_t sensor, int64_t time, uint64_t pulses)
+    {
+        if (m_payload.empty()) {
+            // the checkpoint of a new block
+            m_checkpoint = time;
+            m_last_time = time;
+            m_entries = 0;
+        }
+        put_varint(m_payload, sensor);
+        put_varint(m_payload, zigzag(time - m_last_time));
+        put_varint(m_payload, pulses);
+        m_last_time = time;
+        ++m_entries;
+
+        if (m_payload.size() >= block_target) return flush();
+        return true;
+    }
+
+    // write the pending entries as one block
+    bool flush()
+    {
+        if (m_payload.empty()) return true;
+        if (m_fd < 0) return false;
+
+        m_block.resize(header_size + m_payload.size());
+        uint8_t* header = &m_block[0];
+        put_u32(header, block_magic);
+        put_u32(header + 4, static_cast<uint32_t>(m_payload.size()));
+        put_u32(header + 8, m_entries);
+        put_u64(header + 16, static_cast<uint64_t>(m_checkpoint));
+        memcpy(&m_block[header_size], &m_payload[0], m_payload.size());
+        put_u32(header + 12, CRC32::compute(header + 16, m_block.size() - 16));
+
+        m_payload.clear();
+
+        std::size_t written = 0;
+        while (written < m_block.size()) {
+            ssize_t rc = ::write(m_fd, &m_block[written], m_block.size() - written);
+            if (rc < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            written += static_cast<std::size_t>(rc);
+        }
+        return true;
+    }
+
+    void close()
+    {
+        if (m_fd < 0) return;
+        flush();
+        ::close(m_fd);
+        m_fd = -1;
+    }
+
+private:
+    Writer(const Writer&);
+    Writer& operator=(const Writer&);
+
+    int m_fd = -1;
+    EpochMapping m_epoch_time;
+    std::vector<uint8_t> m_payload;
+    std::vector<uint8_t> m_block;
+    int64_t m_checkpoint = 0;
+    int64_t m_last_time = 0;
+    uint32_t m_entries = 0;
+};
+
+
+// the reader loads a log and decodes it block by block, skipping damaged
+// blocks. The callback gets every entry_t in file order
+
+class Reader {
+public:
+    bool open(const std::string& filename)
+    {
+        m_data.clear();
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+
+        uint8_t buffer[1 << 16];
+        while (true) {
+            ssize_t rc = ::read(fd, buffer, sizeof(buffer));
+            if (rc < 0 && errno == EINTR) continue;
+            if (rc <= 0) break;
+            m_data.insert(m_data.end(), buffer, buffer + rc);
+        }
+        ::close(fd);
+        return true;
+    }
+
+    // the number of damaged blocks found by the last for_each()
+    std::size_t damaged() const { return m_damaged; }
+
+    template <typename Callback>
+    std::size_t for_each(Callback callback)
+    {
+        std::size_t count = 0;
+        m_damaged = 0;
+        if (m_data.empty()) return 0;
+
+        const uint8_t* p = &m_data[0];
+        const uint8_t* end = p + m_data.size();
+
+        while (end - p >= static_cast<std::ptrdiff_t>(header_size)) {
+            long payload = check_block(p, end);
+            if (payload < 0) {
+                // damaged block, resynchronize at the next magic
+                ++m_damaged;
+                p = resync(p + 1, end);
+                continue;
+            }
+
+            count += decode_block(p, callback);
+            p += header_size + payload;
+        }
+
+        return count;
+    }
+
+private:
+    std::vector<uint8_t> m_data;
+    std::size_t m_damaged = 0;
+};
+
+}
+
+#endif
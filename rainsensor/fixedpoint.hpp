@@ -0,0 +1,117 @@
+/*
+
+ fixedpoint.hpp
+
+ the rainfall of a number of pulses in integer arithmetic. The
+ calibration of a gauge, its collector area in millionths of a square
+ centimeter and its volume per pulse in milliliters, is turned once into
+ the exact rainfall of one pulse in picometers (1e-9 mm), split into
+ whole micrometers and a remainder. Converting pulses then takes two
+ multiplications and a division by a constant, without floating point
+ until the final micrometers are scaled to millimeters, so the results
+ are the same on every platform and a bulk conversion has no branches.
+
+ */
+
+#ifndef RAINSENSOR_FIXEDPOINT_HPP
+#define RAINSENSOR_FIXEDPOINT_HPP
+
+#include <stdint.h>
+
+#include <string>
+
+
+namespace fixedpoint {
+
+const uint64_t micro = 1000000;
+
+
+// a decimal number like "127.455166" as an integer in units of
+// 10^-decimals, exact and without going through a double. Returns false
+// for anything else, or more decimals than given
+
+inline bool parse(const std::string& text, int decimals, uint64_t& value)
+{
+    value = 0;
+    std::string::const_iterator it = text.begin();
+    bool digits = false;
+    for (; it != text.end() && *it >= '0' && *it <= '9'; ++it) {
+        if (value > (UINT64_MAX - 9) / 10) return false;
+        value = value * 10 + static_cast<uint64_t>(*it - '0');
+        digits = true;
+    }
+    int fraction = 0;
+    if (it != text.end() && *it == '.') {
+        for (++it; it != text.end() && *it >= '0' && *it <= '9'; ++it) {
+            if (++fraction > decimals || value > (UINT64_MAX - 9) / 10) return false;
+            value = value * 10 + static_cast<uint64_t>(*it - '0');
+            digits = true;
+        }
+    }
+    if (!digits || it != text.end()) return false;
+    for (; fraction < decimals; ++fraction) {
+        if (value > UINT64_MAX / 10) return false;
+        value *= 10;
+    }
+    return true;
+}
+
+
+// the rainfall of one pulse, exact
+
+class Calibration {
+public:
+    Calibration(uint64_t micro_sqcm = 0, uint64_t milliliter = 0)
+    // sqcm * ml / 1000 mm = micro_sqcm * ml * 1e-9 mm
+    : m_picometers(micro_sqcm * milliliter)
+    , m_whole(m_picometers / micro)
+    , m_fraction(m_picometers % micro) {}
+
+    // rounded to micrometers. Exact as long as pulses times whole
+    // micrometers per pulse fit into 64 bits
+    uint64_t micrometers(uint64_t pulses) const
+    {
+        return to_micrometers(pulses, m_whole, m_fraction);
+    }
+
+    double millimeters(uint64_t pulses) const { return micrometers(pulses) / 1000.0; }
+
+    // for files that store the calibration as a double
+    double mm_per_pulse() const { return m_picometers / 1e9; }
+
+    uint64_t whole() const { return m_whole; }
+    uint64_t fraction() const { return m_fraction; }
+
+    static uint64_t to_micrometers(uint64_t pulses, uint64_t whole, uint64_t fraction)
+    {
+        return pulses * whole + (pulses * fraction + micro / 2) / micro;
+    }
+
+private:
+    uint64_t m_picometers;
+    uint64_t m_whole;    // micrometers per pulse
+    uint64_t m_fraction; // and picometers on top
+};
+
+
+// picometers to millimeters, rounded to the micrometer like Calibration
+
+inline double millimeters(uint64_t picometers)
+{
+    return (picometers + micro / 2) / micro / 1000.0;
+}
+
+
+// the millimeters of many counts at once, with the calibrations split
+// into arrays of whole micrometers and remainders
+
+inline void to_millimeters(const unsigned long* pulses, const uint64_t* whole, const uint64_t* fraction, double* mm, std::size_t count)
+{
+    for (std::size_t i = 0; i < count; ++i) {
+        mm[i] = Calibration::to_micrometers(pulses[i], whole[i], fraction[i]) / 1000.0;
+    }
+}
+
+}
+
+#endif
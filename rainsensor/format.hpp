@@ -0,0 +1,138 @@
+/*
+
+ format.hpp
+
+ number formatting and buffered output for the periodic updates, without
+ iostreams, locales or heap allocations: numbers are converted with a
+ couple of integer divisions straight into a caller supplied buffer, and
+ all lines of a tick are collected in one buffer that goes out with a
+ single write().
+
+ */
+
+#ifndef RAINSENSOR_FORMAT_HPP
+#define RAINSENSOR_FORMAT_HPP
+
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <cmath>
+#include <algorithm>
+#include <vector>
+
+
+// the decimal digits of value at out, returns the end. Needs 20 chars
+
+inline char* format_unsigned(char* out, uint64_t value)
+{
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = static_cast<char>('0' + value % 10);
+        value /= 10;
+    } while (value);
+    while (n) *out++ = digits[--n];
+    return out;
+}
+
+
+// the same, padded with zeroes to width digits
+
+inline char* format_padded(char* out, uint64_t value, int width)
+{
+    char digits[20];
+    char* end = format_unsigned(digits, value);
+    for (int pad = width - static_cast<int>(end - digits); pad > 0; --pad) *out++ = '0';
+    memcpy(out, digits, static_cast<std::size_t>(end - digits));
+    return out + (end - digits);
+}
+
+
+// value with a fixed number of decimals (0..9) at out, like printf("%.*f")
+// but rounding halves away from zero. Returns the end, needs 32 chars
+
+inline char* format_fixed(char* out, double value, int decimals)
+{
+    static const uint64_t scale[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000 };
+    if (decimals < 0) decimals = 0;
+    if (decimals > 9) decimals = 9;
+
+    double scaled = std::fabs(value) * scale[decimals];
+    if (!(scaled < 1.8e19)) {
+        // nan, infinity and the huge ones are rare enough for printf, cut
+        // to what fits
+        int length = snprintf(out, 32, "%.*f", decimals, value);
+        return out + std::max(0, std::min(length, 31));
+    }
+
+    uint64_t units = static_cast<uint64_t>(scaled + 0.5);
+    if (value < 0 && units) *out++ = '-';
+    out = format_unsigned(out, units / scale[decimals]);
+    if (decimals) {
+        *out++ = '.';
+        out = format_padded(out, units % scale[decimals], decimals);
+    }
+    return out;
+}
+
+
+// collects text for a file descriptor and writes it out at once. The
+// buffer keeps its size, so once it fits a whole tick appending does not
+// allocate anymore
+
+class OutputBuffer {
+public:
+    OutputBuffer(int fd = -1, std::size_t capacity = 4096) : m_fd(fd) { m_buffer.reserve(capacity); }
+
+    void set_fd(int fd) { m_fd = fd; }
+
+    OutputBuffer& append(const char* text, std::size_t size)
+    {
+        m_buffer.insert(m_buffer.end(), text, text + size);
+        return *this;
+    }
+
+    OutputBuffer& append(const char* text) { return append(text, strlen(text)); }
+
+    OutputBuffer& append(uint64_t value)
+    {
+        char text[20];
+        return append(text, static_cast<std::size_t>(format_unsigned(text, value) - text));
+    }
+
+    OutputBuffer& append_fixed(double value, int decimals)
+    {
+        char text[32];
+        return append(text, static_cast<std::size_t>(format_fixed(text, value, decimals) - text));
+    }
+
+    std::size_t size() const { return m_buffer.size(); }
+    void clear() { m_buffer.clear(); }
+
+    // write everything collected, returns false on write errors
+    bool flush()
+    {
+        std::size_t written = 0;
+        while (written < m_buffer.size()) {
+            ssize_t rc = ::write(m_fd, &m_buffer[written], m_buffer.size() - written);
+            if (rc < 0) {
+                if (errno == EINTR) continue;
+                m_buffer.clear();
+                return false;
+            }
+            written += static_cast<std::size_t>(rc);
+        }
+        m_buffer.clear();
+        return true;
+    }
+
+private:
+    int m_fd;
+    std::vector<char> m_buffer;
+};
+
+#endif
@@ -0,0 +1,182 @@
+/*
+
+ gpiochip.hpp
+
+ the edges of a contact straight from the Linux GPIO character device
+ (/dev/gpiochipN, uAPI v2), without CppGPIO. The kernel timestamps every
+ edge in its interrupt handler and queues it, so the time of an edge
+ does not depend on when we get to run, and one read() fetches a whole
+ batch of them. The timestamps are CLOCK_MONOTONIC, the clock of
+ std::chrono::steady_clock on Linux.
+
+ The source can also read from any file descriptor that delivers
+ gpio_v2_line_event records, like a pipe fed with recorded edges, so it
+ can be tried without the hardware (or with the kernel's gpio-sim). A
+ "chip" that is a fifo is read that way, other files are refused.
+
+ */
+
+#ifndef RAINSENSOR_GPIOCHIP_HPP
+#define RAINSENSOR_GPIOCHIP_HPP
+
+#ifdef __linux__
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/gpio.h>
+
+#include <string.h>
+#include <errno.h>
+
+#include <string>
+#include <chrono>
+
+#include "debounce.hpp"
+
+#ifdef GPIO_V2_GET_LINE_IOCTL
+#define RAINSENSOR_GPIOCHIP 1
+
+
+class GPIOChipEdgeSource : public EdgeSource {
+public:
+    GPIOChipEdgeSource(std::chrono::milliseconds poll_interval = std::chrono::milliseconds(10)) : m_poll_interval(poll_interval) {}
+    ~GPIOChipEdgeSource() { close(); }
+
+    // request a line of a chip for its falling edges, with the pull up
+    // the contact needs. Returns false and a message on errors
+    bool open(const std::string& chip, unsigned int line, std::string& error)
+    {
+        close();
+
+        int chip_fd = ::open(chip.c_str(), O_RDWR | O_CLOEXEC);
+        if (chip_fd < 0) {
+            error = "Cannot open file " + chip + ": " + strerror(errno);
+            return false;
+        }
+
+        struct gpio_v2_line_request request;
+        memset(&request, 0, sizeof(request));
+        request.offsets[0] = line;
+        request.num_lines = 1;
+        strncpy(request.consumer, "rainsensor", sizeof(request.consumer) - 1);
+        request.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_FALLING | GPIO_V2_LINE_FLAG_BIAS_PULL_UP;
+        // room for the bounces of a downpour between two of our reads
+        request.event_buffer_size = 1024;
+
+        int rc = ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &request);
+        int saved = errno;
+        // not a chip: recorded events, from a fifo that the main loop can
+        // wait on, unlike a regular file
+        if (rc < 0 && saved == ENOTTY) {
+            struct stat status;
+            if (fstat(chip_fd, &status) == 0 && S_ISFIFO(status.st_mode)) return attach(chip_fd, error);
+            ::close(chip_fd);
+            error = "Cannot read " + chip + ": neither a gpio chip nor a fifo";
+            return false;
+        }
+        ::close(chip_fd);
+        if (rc < 0) {
+            error = "Cannot request line " + std::to_string(line) + " of " + chip + ": " + strerror(saved);
+            return false;
+        }
+
+        return attach(request.fd, error);
+    }
+
+    // read the events from an open descriptor instead, which is closed
+    // with the source
+    bool attach(int fd, std::string& error)
+    {
+        close();
+        int flags = fcntl(fd, F_GETFL);
+        if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+            error = std::string("Cannot read edges: ") + strerror(errno);
+            ::close(fd);
+            return false;
+        }
+        m_fd = fd;
+        return true;
+    }
+
+    void close()
+    {
+        if (m_fd >= 0) ::close(m_fd);
+        m_fd = -1;
+        m_next = m_count = 0;
+        m_partial = 0;
+    }
+
+    // the descriptor to wait on for new edges
+    virtual int fd() const { return m_fd; }
+
+    // edges that were lost because the kernel's buffer was full
+    uint64_t lost() const { return m_lost; }
+
+    // the line was requested before start, edges from then on count
+    virtual void start() {}
+
+    virtual bool next_edge(std::chrono::steady_clock::time_point& time)
+    {
+        if (m_next == m_count && !fill()) return false;
+        const struct gpio_v2_line_event& event = m_events[m_next++];
+
+        // the kernel numbers the events of a line, gaps were dropped
+        if (m_line_seqno && event.line_seqno > m_line_seqno + 1) m_lost += event.line_seqno - m_line_seqno - 1;
+        m_line_seqno = event.line_seqno;
+
+        time = std::chrono::steady_clock::time_point(std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::nanoseconds(static_cast<int64_t>(event.timestamp_ns))));
+        return true;
+    }
+
+    virtual std::chrono::steady_clock::time_point next_poll(std::chrono::steady_clock::time_point now)
+    {
+        return now + m_poll_interval;
+    }
+
+private:
+    GPIOChipEdgeSource(const GPIOChipEdgeSource&);
+    GPIOChipEdgeSource& operator=(const GPIOChipEdgeSource&);
+
+    static const std::size_t batch = 64;
+
+    // read a batch of events. A pipe may deliver part of an event, which
+    // is completed by the next read
+    bool fill()
+    {
+        m_next = m_count = 0;
+        if (m_fd < 0) return false;
+
+        uint8_t* buffer = reinterpret_cast<uint8_t*>(m_events);
+        // all events of the last batch are taken, the start of the next goes first
+        memcpy(buffer, m_rest, m_partial);
+        while (true) {
+            ssize_t rc = ::read(m_fd, buffer + m_partial, sizeof(m_events) - m_partial);
+            if (rc < 0 && errno == EINTR) continue;
+            if (rc <= 0) return false;
+
+            std::size_t size = m_partial + static_cast<std::size_t>(rc);
+            m_count = size / sizeof(m_events[0]);
+            m_partial = size % sizeof(m_events[0]);
+            // keep the start of the next event for the next read
+            memcpy(m_rest, buffer + m_count * sizeof(m_events[0]), m_partial);
+            if (m_count) return true;
+        }
+    }
+
+    int m_fd = -1;
+    std::chrono::milliseconds m_poll_interval;
+    struct gpio_v2_line_event m_events[batch];
+    std::size_t m_next = 0;
+    std::size_t m_count = 0;
+    std::size_t m_partial = 0;
+    uint8_t m_rest[sizeof(struct gpio_v2_line_event)];
+    uint32_t m_line_seqno = 0;
+    uint64_t m_lost = 0;
+};
+
+#endif
+#endif
+#endif
@@ -0,0 +1,353 @@
+/*
+
+ logindex.hpp
+
+ range queries over an event log: the pulses of a sensor between two
+ times, and the largest total within any aligned window of a range (say
+ the wettest hour of June).
+
+ The log is memory mapped and described by a sparse index with one
+ record per block: its offset, the earliest and the latest time in it,
+ and the pulses of every sensor that appears in it. A range query adds
+ the totals of all blocks that lie completely inside the range and only
+ decodes the blocks at its two ends. When the blocks are in time order
+ (the usual case) the boundary blocks are found by binary search, so a
+ query costs two block decodes whatever the length of the log.
+
+ Building the index takes one pass over the log, so it is kept in a
+ file next to the log (log name with .idx appended), written to a
+ temporary file and renamed, and extended with the blocks appended since:
+
+   header (32 bytes):  magic "RSIX", version, crc32 over the records,
+                       size of the log covered, number of records
+   records:            uint64 offset, int64 earliest and latest time,
+                       uint32 number of sensors, followed by that many
+                       pairs of uint32 sensor and uint64 pulses
+
+ all little endian like the log.
+
+ */
+
+#ifndef RAINSENSOR_LOGINDEX_HPP
+#define RAINSENSOR_LOGINDEX_HPP
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include "eventlog.hpp"
+
+
+namespace eventlog {
+
+const uint32_t index_magic = 0x58495352; // "RSIX" in little endian
+const uint32_t index_version = 1;
+const std::size_t index_header_size = 32;
+
+
+class IndexedLog {
+public:
+    IndexedLog() {}
+    ~IndexedLog() { close(); }
+
+    // map a log and load or build its index. With save_index set, an index
+    // that had to be extended is written back
+    bool open(const std::string& filename, bool save_index = true)
+    {
+        close();
+
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return false;
+        }
+        m_size = static_cast<std::size_t>(st.st_size);
+        if (m_size) {
+            void* map = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (map == MAP_FAILED) {
+                ::close(fd);
+                return false;
+            }
+            m_data = static_cast<const uint8_t*>(map);
+        }
+        ::close(fd);
+
+        m_index_filename = filename + ".idx";
+        std::size_t covered = load_index();
+        if (covered < m_size) {
+            scan(covered);
+            if (save_index) write_index();
+        }
+        return true;
+    }
+
+    void close()
+    {
+        if (m_data) munmap(const_cast<uint8_t*>(m_data), m_size);
+        m_data = nullptr;
+        m_size = 0;
+        m_blocks.clear();
+        m_ordered = true;
+    }
+
+    // the pulses of a sensor in [from, to), times in microseconds since the epoch
+    uint64_t total(uint32_t sensor, int64_t from, int64_t to) const
+    {
+        uint64_t sum = 0;
+        if (to <= from) return 0;
+
+        std::size_t b = first_block(from);
+        for (; b < m_blocks.size(); ++b) {
+            const block_t& block = m_blocks[b];
+            if (block.earliest >= to) {
+                if (m_ordered) break;
+                continue;
+            }
+            if (block.latest < from) continue;
+
+            if (block.earliest >= from && block.latest < to) {
+                // the whole block counts, take its total
+                sum += block_total(block, sensor);
+                continue;
+            }
+
+            // a boundary block: decode it
+            decode_block(m_data + block.offset, [&](const entry_t& entry) {
+                if (entry.sensor == sensor && entry.time >= from && entry.time < to) sum += entry.pulses;
+            });
+        }
+
+        return sum;
+    }
+
+    // the largest total of a sensor within the windows of the given length
+    // that are aligned to multiples of it and overlap [from, to). Returns the
+    // total and the start of its window (the first one on ties)
+    uint64_t max_window(uint32_t sensor, int64_t from, int64_t to, int64_t window, int64_t& window_start) const
+    {
+        uint64_t best = 0;
+        window_start = from;
+        if (window <= 0 || to <= from) return 0;
+
+        for (int64_t start = floor_multiple(from, window); start < to; start += window) {
+            uint64_t sum = total(sensor, std::max(start, from), std::min(start + window, to));
+            if (sum > best) {
+                best = sum;
+                window_start = start;
+            }
+        }
+        return best;
+    }
+
+    std::size_t blocks() const { return m_blocks.size(); }
+    std::size_t size() const { return m_size; }
+
+    // the time span of the log, 0 without blocks
+    int64_t earliest() const { return m_blocks.empty() ? 0 : m_earliest; }
+    int64_t latest() const { return m_blocks.empty() ? 0 : m_latest; }
+
+private:
+    IndexedLog(const IndexedLog&);
+    IndexedLog& operator=(const IndexedLog&);
+
+    struct block_t {
+        uint64_t offset = 0;
+        int64_t earliest = 0;
+        int64_t latest = 0;
+        std::vector<std::pair<uint32_t, uint64_t> > totals; // sorted by sensor
+    };
+
+    static int64_t floor_multiple(int64_t time, int64_t step)
+    {
+        int64_t q = time / step;
+        if (time % step < 0) --q;
+        return q * step;
+    }
+
+    static uint64_t block_total(const block_t& block, uint32_t sensor)
+    {
+        std::vector<std::pair<uint32_t, uint64_t> >::const_iterator it =
+            std::lower_bound(block.totals.begin(), block.totals.end(), std::make_pair(sensor, uint64_t(0)));
+        return it != block.totals.end() && it->first == sensor ? it->second : 0;
+    }
+
+    // the first block that may hold entries at or after time
+    std::size_t first_block(int64_t time) const
+    {
+        if (!m_ordered) return 0;
+        std::size_t low = 0, high = m_blocks.size();
+        while (low < high) {
+            std::size_t mid = low + (high - low) / 2;
+            if (m_blocks[mid].latest < time) low = mid + 1;
+            else high = mid;
+        }
+        return low;
+    }
+
+    void add_block(const block_t& block)
+    {
+        if (m_blocks.empty()) {
+            m_earliest = block.earliest;
+            m_latest = block.latest;
+        } else {
+            if (block.earliest < m_blocks.back().latest) m_ordered = false;
+            m_earliest = std::min(m_earliest, block.earliest);
+            m_latest = std::max(m_latest, block.latest);
+        }
+        m_blocks.push_back(block);
+    }
+
+    // index the blocks from offset to the end of the log
+    void scan(std::size_t offset)
+    {
+        const uint8_t* p = m_data + offset;
+        const uint8_t* end = m_data + m_size;
+
+        while (end - p >= static_cast<std::ptrdiff_t>(header_size)) {
+            long payload = check_block(p, end);
+            if (payload < 0) {
+                p = resync(p + 1, end);
+                continue;
+            }
+
+            block_t block;
+            block.offset = static_cast<uint64_t>(p - m_data);
+            block.earliest = block.latest = static_cast<int64_t>(get_u64(p + 16));
+            std::map<uint32_t, uint64_t> totals;
+            decode_block(p, [&](const entry_t& entry) {
+                block.earliest = std::min(block.earliest, entry.time);
+                block.latest = std::max(block.latest, entry.time);
+                totals[entry.sensor] += entry.pulses;
+            });
+            block.totals.assign(totals.begin(), totals.end());
+            add_block(block);
+
+            p += header_size + payload;
+        }
+
+        // a torn block at the end may still be completed, index it next time
+        m_covered = m_blocks.empty() ? 0 : static_cast<std::size_t>(m_blocks.back().offset) + header_size + get_u32(m_data + m_blocks.back().offset + 4);
+    }
+
+    // load the index file, returns the size of the log it covers (0 if
+    // there is none or it does not fit the log)
+    std::size_t load_index()
+    {
+        std::vector<uint8_t> data;
+        int fd = ::open(m_index_filename.c_str(), O_RDONLY);
+        if (fd < 0) return 0;
+        uint8_t buffer[1 << 16];
+        while (true) {
+            ssize_t rc = ::read(fd, buffer, sizeof(buffer));
+            if (rc < 0 && errno == EINTR) continue;
+            if (rc <= 0) break;
+            data.insert(data.end(), buffer, buffer + rc);
+        }
+        ::close(fd);
+
+        if (data.size() < index_header_size
+            || get_u32(&data[0]) != index_magic
+            || get_u32(&data[4]) != index_version
+            || CRC32::compute(&data[index_header_size], data.size() - index_header_size) != get_u32(&data[8])) return 0;
+
+        uint64_t covered = get_u64(&data[16]);
+        uint64_t count = get_u64(&data[24]);
+        // a log that shrank was replaced
+        if (covered > m_size) return 0;
+
+        const uint8_t* p = &data[index_header_size];
+        const uint8_t* end = &data[0] + data.size();
+        for (uint64_t n = 0; n < count; ++n) {
+            if (end - p < 28) return reset_index();
+            block_t block;
+            block.offset = get_u64(p);
+            block.earliest = static_cast<int64_t>(get_u64(p + 8));
+            block.latest = static_cast<int64_t>(get_u64(p + 16));
+            uint32_t sensors = get_u32(p + 24);
+            p += 28;
+            if (static_cast<uint64_t>(end - p) < sensors * uint64_t(12) || block.offset + header_size > covered) return reset_index();
+            for (uint32_t s = 0; s < sensors; ++s, p += 12) {
+                block.totals.push_back(std::make_pair(get_u32(p), get_u64(p + 4)));
+            }
+            add_block(block);
+        }
+
+        // the indexed blocks must still be there
+        if (!m_blocks.empty() && check_block(m_data + m_blocks.back().offset, m_data + m_size) < 0) return reset_index();
+        m_covered = static_cast<std::size_t>(covered);
+        return m_covered;
+    }
+
+    std::size_t reset_index()
+    {
+        m_blocks.clear();
+        m_ordered = true;
+        return 0;
+    }
+
+    // write the index next to the log, replacing the old one at once
+    bool write_index() const
+    {
+        std::vector<uint8_t> data(index_header_size);
+        for (std::vector<block_t>::const_iterator it = m_blocks.begin(); it != m_blocks.end(); ++it) {
+            uint8_t record[28];
+            put_u64(record, it->offset);
+            put_u64(record + 8, static_cast<uint64_t>(it->earliest));
+            put_u64(record + 16, static_cast<uint64_t>(it->latest));
+            put_u32(record + 24, static_cast<uint32_t>(it->totals.size()));
+            data.insert(data.end(), record, record + sizeof(record));
+            for (std::size_t s = 0; s < it->totals.size(); ++s) {
+                uint8_t pair[12];
+                put_u32(pair, it->totals[s].first);
+                put_u64(pair + 4, it->totals[s].second);
+                data.insert(data.end(), pair, pair + sizeof(pair));
+            }
+        }
+        put_u32(&data[0], index_magic);
+        put_u32(&data[4], index_version);
+        put_u32(&data[8], CRC32::compute(&data[index_header_size], data.size() - index_header_size));
+        put_u32(&data[12], 0);
+        put_u64(&data[16], m_covered);
+        put_u64(&data[24], m_blocks.size());
+
+        std::string temp = m_index_filename + ".tmp";
+        int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        std::size_t written = 0;
+        while (written < data.size()) {
+            ssize_t rc = ::write(fd, &data[written], data.size() - written);
+            if (rc < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            written += static_cast<std::size_t>(rc);
+        }
+        bool ok = ::close(fd) == 0 && written == data.size();
+        return ok && rename(temp.c_str(), m_index_filename.c_str()) == 0;
+    }
+
+    const uint8_t* m_data = nullptr;
+    std::size_t m_size = 0;
+    std::size_t m_covered = 0;
+    std::string m_index_filename;
+    std::vector<block_t> m_blocks;
+    bool m_ordered = true;
+    int64_t m_earliest = 0;
+    int64_t m_latest = 0;
+};
+
+}
+
+#endif
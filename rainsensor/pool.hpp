@@ -0,0 +1,102 @@
+/*
+
+ pool.hpp
+
+ a small work stealing thread pool for batch jobs like the replay of
+ event logs. Every worker has its own deque of tasks: it takes work from
+ the back of its own deque and, once that is empty, steals from the front
+ of the others'. With tasks of very different length (a busy gauge next
+ to a dry one) this keeps all workers busy, without a central queue that
+ everyone contends on.
+
+ */
+
+#ifndef RAINSENSOR_POOL_HPP
+#define RAINSENSOR_POOL_HPP
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <memory>
+
+
+class WorkStealingPool {
+public:
+    typedef std::function<void()> task_t;
+
+    // threads 0 = one per hardware thread
+    WorkStealingPool(unsigned int threads = 0)
+    {
+        if (!threads) threads = std::thread::hardware_concurrency();
+        if (!threads) threads = 1;
+        for (unsigned int i = 0; i < threads; ++i) m_queues.push_back(std::unique_ptr<queue_t>(new queue_t));
+    }
+
+    std::size_t threads() const { return m_queues.size(); }
+
+    // queue a task, spread round robin over the workers
+    void add(task_t task)
+    {
+        queue_t& queue = *m_queues[m_next++ % m_queues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+
+    // run all queued tasks and return when they are done. Tasks must not add
+    // further tasks
+    void run()
+    {
+        std::vector<std::thread> workers;
+        for (std::size_t i = 1; i < m_queues.size(); ++i) workers.push_back(std::thread(&WorkStealingPool::work, this, i));
+        // the calling thread is worker 0
+        work(0);
+        for (std::size_t i = 0; i < workers.size(); ++i) workers[i].join();
+    }
+
+private:
+    struct queue_t {
+        std::mutex mutex;
+        std::deque<task_t> tasks;
+    };
+
+    void work(std::size_t self)
+    {
+        task_t task;
+        while (take(self, task) || steal(self, task)) {
+            task();
+            task = task_t();
+        }
+    }
+
+    bool take(std::size_t self, task_t& task)
+    {
+        queue_t& queue = *m_queues[self];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) return false;
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+        return true;
+    }
+
+    // the queues only shrink while running, so one round over all of them
+    // that finds nothing means that the work is done
+    bool steal(std::size_t self, task_t& task)
+    {
+        for (std::size_t n = 1; n < m_queues.size(); ++n) {
+            queue_t& queue = *m_queues[(self + n) % m_queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty()) continue;
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+    std::vector<std::unique_ptr<queue_t> > m_queues;
+    std::size_t m_next = 0;
+};
+
+#endif
@@ -0,0 +1,164 @@
+/*
+
+ publisher.hpp
+
+ writes the current rainfall of a sensor into its output file, in one of
+ three ways:
+
+ truncate: rewrite the file in place (the historic behaviour). Readers
+           may see an empty or partial file.
+
+ rename:   write a temporary file next to it and rename it over the
+           output file. Readers always see a complete file.
+
+ mmap:     the file is a fixed size slot of 64 bytes, mapped into memory
+           and updated without any system call:
+
+           <sequence> <value> <sequence>\n
+
+           both sequence numbers are 20 digits, the value 21 characters,
+           right aligned. The writer stores the trailing sequence number
+           first, then the value, then the leading one, so a reader that
+           reads front to back and finds both numbers equal has an
+           untorn value.
+
+ */
+
+#ifndef RAINSENSOR_PUBLISHER_HPP
+#define RAINSENSOR_PUBLISHER_HPP
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <string>
+#include <atomic>
+
+#include "format.hpp"
+
+
+class Publisher {
+public:
+    enum method_t { TRUNCATE, RENAME, MMAP };
+
+    static const std::size_t slot_size = 64;
+
+    Publisher() {}
+    ~Publisher() { close(); }
+
+    // prepare publishing into filename, returns false if the file cannot be created
+    bool open(const std::string& filename, method_t method)
+    {
+        close();
+        m_filename = filename;
+        m_temp_filename = filename + ".tmp";
+        m_method = method;
+
+        if (method != MMAP) {
+            // make sure we can write there
+            int fd = ::open((method == RENAME ? m_temp_filename : m_filename).c_str(), O_WRONLY | O_CREAT, 0644);
+            if (fd < 0) return false;
+            ::close(fd);
+            return true;
+        }
+
+        int fd = ::open(m_filename.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) return false;
+
+        // preallocate the slot
+        if (ftruncate(fd, slot_size) != 0) {
+            ::close(fd);
+            return false;
+        }
+
+        void* map = mmap(nullptr, slot_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (map == MAP_FAILED) return false;
+
+        m_slot = static_cast<char*>(map);
+        memset(m_slot, ' ', slot_size);
+        m_slot[slot_size - 1] = '\n';
+        return true;
+    }
+
+    void close()
+    {
+        if (m_slot) munmap(m_slot, slot_size);
+        m_slot = nullptr;
+    }
+
+    // publish a new value, returns false on write errors
+    bool publish(double value)
+    {
+        ++m_sequence;
+
+        if (m_method == MMAP) {
+            // "%020llu %21.2f %020llu\n"
+            char text[slot_size];
+            char number[32];
+            std::size_t length = static_cast<std::size_t>(format_fixed(number, value, 2) - number);
+            if (length > 21) length = 21;
+            format_padded(text, m_sequence, 20);
+            memset(text + 20, ' ', 22 - length);
+            memcpy(text + 42 - length, number, length);
+            text[42] = ' ';
+            format_padded(text + 43, m_sequence, 20);
+            text[63] = '\n';
+            // trailing sequence, value, leading sequence - in this order
+            memcpy(m_slot + 43, text + 43, 21);
+            std::atomic_thread_fence(std::memory_order_release);
+            memcpy(m_slot + 20, text + 20, 23);
+            std::atomic_thread_fence(std::memory_order_release);
+            memcpy(m_slot, text, 20);
+            return true;
+        }
+
+        char text[34];
+        char* end = format_fixed(text, value, 2);
+        *end++ = '\n';
+        std::size_t length = static_cast<std::size_t>(end - text);
+
+        const std::string& target = m_method == RENAME ? m_temp_filename : m_filename;
+        int fd = ::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        bool ok = write_all(fd, text, length);
+        if (::close(fd) != 0) ok = false;
+
+        if (ok && m_method == RENAME) ok = rename(m_temp_filename.c_str(), m_filename.c_str()) == 0;
+        return ok;
+    }
+
+    uint64_t sequence() const { return m_sequence; }
+    const std::string& filename() const { return m_filename; }
+
+private:
+    Publisher(const Publisher&);
+    Publisher& operator=(const Publisher&);
+
+    static bool write_all(int fd, const char* data, std::size_t size)
+    {
+        while (size) {
+            ssize_t rc = ::write(fd, data, size);
+            if (rc < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            data += rc;
+            size -= static_cast<std::size_t>(rc);
+        }
+        return true;
+    }
+
+    std::string m_filename;
+    std::string m_temp_filename;
+    method_t m_method = RENAME;
+    char* m_slot = nullptr;
+    uint64_t m_sequence = 0;
+};
+
+#endif
@@ -0,0 +1,275 @@
+/*
+
+ pulsesource.hpp
+
+ abstraction of the device that delivers the tipping bucket pulses. The
+ main loop only needs a monotonically increasing event counter, so it can
+ be fed either by a GPIO::Counter on the Raspberry Pi or by a deterministic
+ generator for load tests and benchmarks on any Linux box.
+
+ define RAINSENSOR_NO_CPPGPIO to build without the CppGPIO library (then
+ the simulated source and, on Linux, the gpio character device of
+ gpiochip.hpp remain available).
+
+ */
+
+#ifndef RAINSENSOR_PULSESOURCE_HPP
+#define RAINSENSOR_PULSESOURCE_HPP
+
+#include <stdint.h>
+
+#include <cmath>
+#include <chrono>
+#include <limits>
+#include <random>
+#include <vector>
+#include <algorithm>
+
+#ifndef RAINSENSOR_NO_CPPGPIO
+#include <cppgpio.hpp>
+#endif
+
+#include "clock.hpp"
+
+
+// the interface every pulse source implements
+
+class PulseSource {
+public:
+    virtual ~PulseSource() {}
+
+    // start counting
+    virtual void start() = 0;
+
+    // return the number of pulses since start()
+    virtual unsigned long get_count() = 0;
+
+    // the time at which get_count() should be called next to see a new
+    // pulse without delay. Sources that cannot know it are polled in
+    // short intervals
+    virtual std::chrono::steady_clock::time_point next_poll(std::chrono::steady_clock::time_point now)
+    {
+        return now + std::chrono::milliseconds(10);
+    }
+
+    // a descriptor that turns readable when there may be new pulses, so
+    // the source is read when that happens instead of polled. -1 if the
+    // source has none
+    virtual int fd() const { return -1; }
+
+    // the time of the newest pulse counted by get_count(), for sources that
+    // timestamp their pulses themselves. False for the others, their pulses
+    // get the time they were read
+    virtual bool last_pulse(std::chrono::steady_clock::time_point& when) const
+    {
+        (void)when;
+        return false;
+    }
+
+    // the edges accepted and rejected as bounces and the current settle
+    // time, for sources that debounce themselves. False for the others
+    virtual bool debounce_counts(uint64_t& accepted, uint64_t& rejected, std::chrono::microseconds& settle) const
+    {
+        (void)accepted;
+        (void)rejected;
+        (void)settle;
+        return false;
+    }
+};
+
+
+#ifndef RAINSENSOR_NO_CPPGPIO
+
+// the real thing: a debounced counter on a GPIO input
+
+class GPIOPulseSource : public PulseSource {
+public:
+    // the Counter debounces with a fixed time, by default a very conservative one
+    GPIOPulseSource(unsigned int pin, std::chrono::milliseconds poll_interval = std::chrono::milliseconds(10),
+                    std::chrono::milliseconds debounce = std::chrono::milliseconds(500))
+    : m_counter(pin, GPIO::GPIO_PULL::UP, debounce, std::chrono::milliseconds(5))
+    , m_poll_interval(poll_interval) {}
+
+    virtual void start() { m_counter.start(); }
+    virtual unsigned long get_count() { return m_counter.get_count(); }
+
+    // the counter counts in its own thread, we can only look at it regularly
+    virtual std::chrono::steady_clock::time_point next_poll(std::chrono::steady_clock::time_point now)
+    {
+        return now + m_poll_interval;
+    }
+
+private:
+    GPIO::Counter m_counter;
+    std::chrono::milliseconds m_poll_interval;
+};
+
+#endif
+
+
+// parameters of the synthetic pulse generator
+
+struct simulation_t {
+    double rate = 1;            // mean pulses per second outside of bursts
+    double burst_rate = 0;      // mean pulses per second during a burst
+    double burst_every = 0;     // mean seconds between the start of two bursts (0 = no bursts)
+    double burst_length = 0;    // duration of a burst in seconds
+    double jitter = 0;          // 0 = strictly periodic pulses, 1 = exponential (poisson) spacing
+    unsigned long seed = 1;     // same seed, same pulse train
+    unsigned int bounces = 0;   // extra edges of the contact per pulse, debounced with -B
+    double bounce_time = 0.005; // seconds over which they spread
+};
+
+
+// a deterministic pulse generator. The pulse times only depend on the
+// parameters and the seed, never on when or how often the counter is read,
+// so two runs with the same seed see exactly the same pulse train.
+
+class SimulatedPulseSource : public PulseSource {
+public:
+    SimulatedPulseSource(const simulation_t& simulation)
+    : m_sim(simulation)
+    , m_random(simulation.seed)
+    {
+        if (m_sim.jitter < 0) m_sim.jitter = 0;
+        if (m_sim.jitter > 1) m_sim.jitter = 1;
+        m_burst_start = next_burst_start(0);
+        m_burst_end = m_burst_start + m_sim.burst_length;
+        m_next = next_pulse(0);
+    }
+
+    virtual void start()
+    {
+        m_start = std::chrono::steady_clock::now();
+    }
+
+    // count the pulses that happened until now (in real time)
+    virtual unsigned long get_count()
+    {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - m_start;
+        return count_until(elapsed.count());
+    }
+
+    // count the pulses that happened until the given number of seconds
+    // after start(). Time cannot run backwards, so earlier values return
+    // the count reached so far.
+    unsigned long count_until(double seconds)
+    {
+        while (m_next <= seconds) {
+            ++m_count;
+            m_next = next_pulse(m_next);
+        }
+        return m_count;
+    }
+
+    // the time of the next pulse in seconds after start()
+    double next_pulse_time() const { return m_next; }
+
+    // we know exactly when the next pulse happens
+    virtual std::chrono::steady_clock::time_point next_poll(std::chrono::steady_clock::time_point now)
+    {
+        // no more pulses at all, or none within the next hour
+        if (m_next - std::chrono::duration<double>(now - m_start).count() > 3600) return now + std::chrono::hours(1);
+        return m_start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(m_next));
+    }
+
+private:
+    static double infinity() { return std::numeric_limits<double>::infinity(); }
+
+    double exponential()
+    {
+        return m_exponential(m_random);
+    }
+
+    double next_burst_start(double after)
+    {
+        if (m_sim.burst_every <= 0 || m_sim.burst_length <= 0) return infinity();
+        return after + m_sim.burst_every * exponential();
+    }
+
+    // compute the pulse following the one at time t. Rate changes at burst
+    // boundaries restart the spacing from the boundary.
+    double next_pulse(double t)
+    {
+        while (true) {
+            bool in_burst = t >= m_burst_start;
+            double boundary = in_burst ? m_burst_end : m_burst_start;
+            double rate = in_burst ? m_sim.burst_rate : m_sim.rate;
+
+            double next = infinity();
+            if (rate > 0) {
+                double spacing = (1 - m_sim.jitter) + m_sim.jitter * exponential();
+                next = t + spacing / rate;
+            }
+
+            if (next <= boundary) return next;
+
+            // nothing happens before the boundary - and no boundary left
+            if (std::isinf(boundary)) return infinity();
+
+            t = boundary;
+            if (in_burst) {
+                m_burst_start = next_burst_start(m_burst_end);
+                m_burst_end = m_burst_start + m_sim.burst_length;
+            }
+        }
+    }
+
+    simulation_t m_sim;
+    std::mt19937_64 m_random;
+    std::exponential_distribution<double> m_exponential;
+    std::chrono::steady_clock::time_point m_start = std::chrono::steady_clock::now();
+    double m_burst_start = 0;
+    double m_burst_end = 0;
+    double m_next = 0;
+    unsigned long m_count = 0;
+};
+
+// replays recorded pulses on a virtual clock: the count includes all
+// pulses recorded up to the time of the clock
+
+class ReplayPulseSource : public PulseSource {
+public:
+    ReplayPulseSource(const VirtualClock& clock) : m_clock(clock) {}
+
+    // add a recorded pulse count, times in microseconds since the epoch
+    void add(int64_t time, unsigned long pulses) { m_events.push_back(std::make_pair(time, pulses)); }
+
+    // the time of the first pulse, after start()
+    int64_t first() const { return m_events.empty() ? 0 : m_events.front().first; }
+    int64_t last() const { return m_events.empty() ? 0 : m_events.back().first; }
+
+    virtual void start()
+    {
+        // logs of several runs may overlap a little
+        std::stable_sort(m_events.begin(), m_events.end(), earlier);
+        m_next = 0;
+        m_count = 0;
+    }
+
+    virtual unsigned long get_count()
+    {
+        int64_t now = VirtualClock::to_epoch(m_clock.now());
+        while (m_next < m_events.size() && m_events[m_next].first <= now) m_count += m_events[m_next++].second;
+        return m_count;
+    }
+
+    virtual std::chrono::steady_clock::time_point next_poll(std::chrono::steady_clock::time_point now)
+    {
+        if (m_next == m_events.size()) return now + std::chrono::hours(24);
+        return VirtualClock::from_epoch(m_events[m_next].first);
+    }
+
+private:
+    static bool earlier(const std::pair<int64_t, unsigned long>& a, const std::pair<int64_t, unsigned long>& b)
+    {
+        return a.first < b.first;
+    }
+
+    const VirtualClock& m_clock;
+    std::vector<std::pair<int64_t, unsigned long> > m_events;
+    std::size_t m_next = 0;
+    unsigned long m_count = 0;
+};
+
+#endif
@@ -6,121 +6,1415 @@
  
  compile:
  
- g++ -std=gnu++11 -pthread -o rainsensor rainsensor.cpp -lcppgpio
+ g++ -std=gnu++11 -pthread -o rainsensor rainsensor.cpp -lcppgpio -lrt
+ 
+ or, without the CppGPIO library (simulated pulses only):
+ 
+ g++ -std=gnu++11 -pthread -DRAINSENSOR_NO_CPPGPIO -o rainsensor rainsensor.cpp -lrt
  
  run:
  
  sudo ./rainsensor
  
+ or with a simulated rain gauge:
+ 
+ ./rainsensor -p -S rate=0.05,jitter=1,seed=7
+ 
+ with RAINSENSOR_NO_MAIN defined the file leaves out main(), so that the
+ benchmark can include it and time the updates the way they run here
+ 
  */
 
-#include <string.h>
-#include <errno.h>
-#include <stdlib.h>
-#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <algorithm>
+#include <limits>
+#include <map>
+
+#include "pulsesource.hpp"
+#include "sensors.hpp"
+#include "eventlog.hpp"
+#include "publisher.hpp"
+#include "rainshm.hpp"
+#include "clock.hpp"
+#include "checkpoint.hpp"
+#include "rrd.hpp"
+#include "logindex.hpp"
+#include "counts.hpp"
+#include "pool.hpp"
+#include "format.hpp"
+#include "fixedpoint.hpp"
+#include "capture.hpp"
+#include "debounce.hpp"
+#include "edgelog.hpp"
+#include "gpiochip.hpp"
+#include "reactor.hpp"
+
+
+// keep the startup options in a struct
+
+struct option_t {
+    std::string filename;
+    bool print_to_console = false;
+    std::chrono::milliseconds interval = std::chrono::minutes(5);
+    std::chrono::milliseconds bucket_width = std::chrono::milliseconds(0); // 0 = derived from the interval
+    int gpio_pin = 0;
+    std::string gpio_chip;
+    int milliliter = 5;
+    uint64_t micro_sqcm = 127000000; // in millionths, exact value of default device is 127.455166
+    bool simulate = false;
+    simulation_t simulation;
+    debounce_t debounce;
+    std::string edge_log; // the raw edges of the sources that debounce themselves
+    std::string edge_analysis; // a recording of them to find the debouncing for
+    int simulated_sensors = 1;
+    int event_poll = 0; // milliseconds, 0 = interval polling
+    bool capture = false; // read the pulse sources in a thread of their own
+    int capture_cpu = -1; // and pin it to this cpu, -1 = any
+    std::chrono::milliseconds intensity_period = std::chrono::milliseconds(0); // 0 = no intensity estimate
+    std::string sensor_list;
+    std::string curve_file;
+    std::shared_ptr<const TipCurve> curve;
+    std::string event_log;
+    Publisher::method_t publish_method = Publisher::RENAME;
+    std::string shared_memory;
+    std::string control_socket; // a unix socket that answers with the current rainfall
+    std::vector<window_spec_t> windows;
+    bool print_lateness = false;
+    std::string checkpoint;
+    int checkpoint_sync = 1; // sync every n-th checkpoint to disk, 0 = never
+    bool history = false;
+    std::vector<rrd::archive_spec_t> archives;
+    bool counts = false;
+    std::string query;
+    std::string patch;
+    std::vector<std::string> replay;
+    int threads = 0; // 0 = one per hardware thread
+    std::vector<sensor_option_t> sensors;
+};
+
+
+// split a comma separated list of key=value pairs, e.g. "rate=1000,jitter=0.5,seed=42"
+
+typedef std::vector<std::pair<std::string, std::string> > key_value_vec_t;
+
+bool split_key_values(const std::string& spec, key_value_vec_t& pairs)
+{
+    std::string::size_type pos = 0;
+
+    while (pos < spec.size()) {
+        std::string::size_type end = spec.find(',', pos);
+        if (end == std::string::npos) end = spec.size();
+        std::string item = spec.substr(pos, end - pos);
+        pos = end + 1;
+
+        std::string::size_type eq = item.find('=');
+        if (eq == std::string::npos) return false;
+        pairs.push_back(std::make_pair(item.substr(0, eq), item.substr(eq + 1)));
+    }
+
+    return true;
+}
+
+
+// convert a number, reject trailing garbage and negative values
+
+bool parse_number(const std::string& text, double& number)
+{
+    const char* value = text.c_str();
+    char* value_end = nullptr;
+    number = strtod(value, &value_end);
+    return value_end != value && *value_end == 0 && number >= 0;
+}
+
+
+// parse a collector area like 127.455166 into millionths of a square centimeter
+
+bool parse_sqcm(const std::string& text, uint64_t& micro_sqcm)
+{
+    return fixedpoint::parse(text, 6, micro_sqcm) && micro_sqcm >= fixedpoint::micro && micro_sqcm <= 10000 * fixedpoint::micro;
+}
+
+
+// convert a duration like 100ms, 30s, 10m, 24h or 7d into milliseconds, plain numbers are minutes
+
+bool parse_long_duration(const std::string& text, uint64_t& milliseconds)
+{
+    const char* value = text.c_str();
+    char* value_end = nullptr;
+    uint64_t number = strtoull(value, &value_end, 10);
+    if (value_end == value || !number || *value == '-') return false;
+
+    std::string unit(value_end);
+    uint64_t factor;
+    if (unit.empty() || unit == "m") factor = 60000;
+    else if (unit == "ms") factor = 1;
+    else if (unit == "s") factor = 1000;
+    else if (unit == "h") factor = 3600000;
+    else if (unit == "d") factor = 86400000;
+    else return false;
+
+    if (number > std::numeric_limits<uint64_t>::max() / factor) return false;
+    milliseconds = number * factor;
+    return true;
+}
+
+// the same for durations that fit an unsigned long on every platform (up to 49 days)
+
+bool parse_duration(const std::string& text, unsigned long& milliseconds)
+{
+    uint64_t value;
+    if (!parse_long_duration(text, value) || value > std::numeric_limits<unsigned long>::max()) return false;
+    milliseconds = static_cast<unsigned long>(value);
+    return true;
+}
+
+
+// the greatest common divisor, for the default bucket width
+
+unsigned long gcd(unsigned long a, unsigned long b)
+{
+    while (b) {
+        unsigned long r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+
+// parse a list of rolling windows, e.g. "10m,24h:1h,7d" (length[:resolution])
+
+bool parse_windows(const std::string& spec, std::vector<window_spec_t>& windows)
+{
+    std::string::size_type pos = 0;
+
+    while (pos < spec.size()) {
+        std::string::size_type end = spec.find(',', pos);
+        if (end == std::string::npos) end = spec.size();
+        std::string item = spec.substr(pos, end - pos);
+        pos = end + 1;
+
+        window_spec_t window;
+        std::string::size_type colon = item.find(':');
+        window.label = item.substr(0, colon);
+        if (!parse_duration(window.label, window.length)) return false;
+        if (colon != std::string::npos && !parse_duration(item.substr(colon + 1), window.resolution)) return false;
+        windows.push_back(window);
+    }
+
+    return !windows.empty();
+}
+
+
+// parse a list of history archives, e.g. "1m:2d,10m:60d,1h:3650d" (step:length)
+
+bool parse_archives(const std::string& spec, std::vector<rrd::archive_spec_t>& archives)
+{
+    std::string::size_type pos = 0;
+
+    while (pos < spec.size()) {
+        std::string::size_type end = spec.find(',', pos);
+        if (end == std::string::npos) end = spec.size();
+        std::string item = spec.substr(pos, end - pos);
+        pos = end + 1;
+
+        std::string::size_type colon = item.find(':');
+        if (colon == std::string::npos) return false;
+        uint64_t step, length;
+        if (!parse_long_duration(item.substr(0, colon), step) || !parse_long_duration(item.substr(colon + 1), length)) return false;
+        // a year of seconds at most per archive
+        if (length % step || length / step > 366 * 86400) return false;
+
+        rrd::archive_spec_t archive;
+        archive.step = static_cast<int64_t>(step);
+        archive.rows = length / step;
+        archives.push_back(archive);
+    }
+
+    return !archives.empty();
+}
+
+
+// parse the parameters of the pulse simulator
+
+bool parse_simulation(const std::string& spec, simulation_t& simulation)
+{
+    key_value_vec_t pairs;
+    if (!split_key_values(spec, pairs)) return false;
+
+    for (key_value_vec_t::const_iterator it = pairs.begin(); it != pairs.end(); ++it) {
+        double number;
+        if (!parse_number(it->second, number)) return false;
+
+        if (it->first == "rate") simulation.rate = number;
+        else if (it->first == "burst-rate") simulation.burst_rate = number;
+        else if (it->first == "burst-every") simulation.burst_every = number;
+        else if (it->first == "burst-length") simulation.burst_length = number;
+        else if (it->first == "jitter") simulation.jitter = number;
+        else if (it->first == "seed") simulation.seed = static_cast<unsigned long>(number);
+        else if (it->first == "bounces" && number <= 100) simulation.bounces = static_cast<unsigned int>(number);
+        else if (it->first == "bounce-time" && number <= 1000) simulation.bounce_time = number / 1000;
+        else return false;
+    }
+
+    return true;
+}
+
+
+// parse the limits of the debouncing, e.g. "min=2ms,max=500ms,margin=2,gap=25ms"
+
+bool parse_debounce(const std::string& spec, debounce_t& debounce)
+{
+    key_value_vec_t pairs;
+    if (!split_key_values(spec, pairs)) return false;
+
+    for (key_value_vec_t::const_iterator it = pairs.begin(); it != pairs.end(); ++it) {
+        if (it->first == "margin") {
+            double number;
+            if (!parse_number(it->second, number) || number < 1 || number > 100) return false;
+            debounce.margin = number;
+            continue;
+        }
+
+        unsigned long milliseconds;
+        if (!parse_duration(it->second, milliseconds) || milliseconds > 10000) return false;
+        std::chrono::microseconds duration = std::chrono::milliseconds(milliseconds);
+
+        if (it->first == "min") debounce.min_settle = duration;
+        else if (it->first == "max") debounce.max_settle = duration;
+        else if (it->first == "gap") debounce.max_gap = duration;
+        else return false;
+    }
+
+    return debounce.min_settle <= debounce.max_settle;
+}
+
+
+// parse one line of the sensor list, e.g. "gpio=17,milliliter=5,sqcm=127,file=/tmp/rain17,curve=/etc/gauge17".
+// Missing keys keep the values given on the command line
+
+bool parse_sensor(const std::string& spec, sensor_option_t& sensor)
+{
+    key_value_vec_t pairs;
+    if (!split_key_values(spec, pairs)) return false;
+
+    for (key_value_vec_t::const_iterator it = pairs.begin(); it != pairs.end(); ++it) {
+        if (it->first == "file") {
+            sensor.filename = it->second;
+            continue;
+        }
+        if (it->first == "curve") {
+            sensor.curve_file = it->second;
+            continue;
+        }
+        if (it->first == "chip") {
+            sensor.gpio_chip = it->second;
+            continue;
+        }
+
+        if (it->first == "sqcm") {
+            if (!parse_sqcm(it->second, sensor.micro_sqcm)) return false;
+            continue;
+        }
+
+        double number;
+        if (!parse_number(it->second, number)) return false;
+
+        if (it->first == "gpio" && number <= 63) sensor.gpio_pin = static_cast<int>(number);
+        else if (it->first == "milliliter" && number >= 1 && number <= 1000) sensor.milliliter = static_cast<int>(number);
+        else return false;
+    }
+
+    return true;
+}
+
+
+// read the sensor list file, one sensor per line, # starts a comment
+
+void read_sensor_list(option_t& options)
+{
+    std::ifstream in(options.sensor_list.c_str());
+
+    if (!in.is_open()) {
+        std::cerr << "Cannot open file " << options.sensor_list << std::endl;
+        exit(1);
+    }
+
+    std::string line;
+    int line_number = 0;
+
+    while (std::getline(in, line)) {
+        ++line_number;
+        std::string::size_type comment = line.find('#');
+        if (comment != std::string::npos) line.erase(comment);
+        // blanks are not part of the syntax
+        std::string spec;
+        for (std::string::const_iterator it = line.begin(); it != line.end(); ++it) {
+            if (!isspace(static_cast<unsigned char>(*it))) spec += *it;
+        }
+        if (spec.empty()) continue;
+
+        sensor_option_t sensor;
+        sensor.gpio_pin = options.gpio_pin;
+        sensor.gpio_chip = options.gpio_chip;
+        sensor.milliliter = options.milliliter;
+        sensor.micro_sqcm = options.micro_sqcm;
+        sensor.curve_file = options.curve_file;
+
+        if (!parse_sensor(spec, sensor)) {
+            std::cerr << "invalid sensor in " << options.sensor_list << " line " << line_number << ": " << line << std::endl;
+            exit(1);
+        }
+
+        options.sensors.push_back(sensor);
+    }
+}
+
+
+// load the calibration curves of all sensors, each file once
+
+void load_curves(option_t& options)
+{
+    std::map<std::string, std::shared_ptr<const TipCurve> > curves;
+
+    for (std::size_t i = 0; i <= options.sensors.size(); ++i) {
+        const std::string& filename = i < options.sensors.size() ? options.sensors[i].curve_file : options.curve_file;
+        std::shared_ptr<const TipCurve>& curve = i < options.sensors.size() ? options.sensors[i].curve : options.curve;
+        if (filename.empty()) continue;
+
+        std::shared_ptr<const TipCurve>& loaded = curves[filename];
+        if (!loaded) {
+            std::shared_ptr<TipCurve> compiled(new TipCurve);
+            std::string error;
+            if (!compiled->load(filename, error)) {
+                std::cerr << error << std::endl;
+                exit(1);
+            }
+            loaded = compiled;
+        }
+        curve = loaded;
+    }
+}
+
+
+// create the pulse source for one sensor, sources with raw edges record
+// them if there is a recorder
+
+std::unique_ptr<PulseSource> make_pulse_source(const option_t& options, const sensor_option_t& sensor, std::size_t index,
+                                               edgelog::Writer* recorder)
+{
+    if (options.simulate) {
+        // every simulated sensor gets its own pulse train
+        simulation_t simulation = options.simulation;
+        simulation.seed += index;
+        if (simulation.bounces) {
+            // a contact that bounces, debounced like a real one
+            std::unique_ptr<EdgeSource> edges(new SimulatedEdgeSource(simulation));
+            return std::unique_ptr<PulseSource>(new DebouncedPulseSource(std::move(edges), options.debounce, recorder, static_cast<uint32_t>(index)));
+        }
+        return std::unique_ptr<PulseSource>(new SimulatedPulseSource(simulation));
+    }
+
+    std::chrono::milliseconds poll_interval(options.event_poll ? options.event_poll : 10);
+
+    if (!sensor.gpio_chip.empty()) {
+#ifdef RAINSENSOR_GPIOCHIP
+        // the kernel timestamps the raw edges, we debounce them
+        GPIOChipEdgeSource* edges = new GPIOChipEdgeSource(poll_interval);
+        std::unique_ptr<EdgeSource> owner(edges);
+        std::string error;
+        if (!edges->open(sensor.gpio_chip, static_cast<unsigned int>(sensor.gpio_pin), error)) {
+            std::cerr << error << std::endl;
+            exit(1);
+        }
+        return std::unique_ptr<PulseSource>(new DebouncedPulseSource(std::move(owner), options.debounce, recorder, static_cast<uint32_t>(index)));
+#else
+        std::cerr << "compiled without support for gpio character devices" << std::endl;
+        exit(1);
+#endif
+    }
+
+#ifndef RAINSENSOR_NO_CPPGPIO
+    return std::unique_ptr<PulseSource>(new GPIOPulseSource(sensor.gpio_pin, poll_interval,
+                                                                std::chrono::duration_cast<std::chrono::milliseconds>(options.debounce.max_settle)));
+#else
+    (void)recorder;
+    std::cerr << "compiled without CppGPIO, use -g to read a gpio character device or -S to simulate a rain gauge" << std::endl;
+    exit(1);
+#endif
+}
+
+
+// everything the rainfall is written to, besides the console
+
+struct outputs_t {
+    std::vector<std::unique_ptr<Publisher> > files; // one per sensor, empty without a file
+    std::vector<std::unique_ptr<Publisher> > window_files; // [window * sensors + sensor]
+    std::vector<std::unique_ptr<Publisher> > intensity_files; // one per sensor with -I, empty without a file
+    eventlog::Writer log;
+    rainshm::Writer shm;
+    EpochMapping epoch_time;
+    checkpoint::File checkpoint;
+    std::vector<uint64_t> state;
+    unsigned long checkpoints = 0;
+    std::vector<std::unique_ptr<rrd::File> > history; // one per sensor, empty without a file
+    std::vector<unsigned long> history_events; // the total events at the last history update
+    std::vector<std::unique_ptr<counts::File> > counts; // one per sensor, empty without a file
+    OutputBuffer console; // the lines of one update for stdout, written at once
+    OutputBuffer reply; // to a query on the control socket
+    edgelog::Writer* edges = nullptr; // the recorder of -E, written out with the event log
+    uint64_t capture_overflows = 0; // reported so far
+};
+
+
+// open the output files of all sensors and the event log
+
+void open_outputs(const option_t& options, const SensorSet& sensors, outputs_t& outputs)
+{
+    outputs.files.resize(sensors.size());
+    outputs.console.set_fd(STDOUT_FILENO);
+
+    for (std::size_t i = 0; i < sensors.size(); ++i) {
+        if (sensors.filename(i).empty()) continue;
+        outputs.files[i].reset(new Publisher);
+        if (!outputs.files[i]->open(sensors.filename(i), options.publish_method)) {
+            std::cerr << "Cannot open file " << sensors.filename(i) << std::endl;
+            exit(1);
+        }
+    }
+
+    // the rolling windows go into files named like the sensor's, with the window appended
+    const WindowCascade& windows = sensors.windows();
+    outputs.window_files.resize(windows.windows() * sensors.size());
+
+    for (std::size_t w = 0; w < windows.windows(); ++w) {
+        for (std::size_t i = 0; i < sensors.size(); ++i) {
+            if (sensors.filename(i).empty()) continue;
+            std::string filename = sensors.filename(i) + "." + windows.spec(w).label;
+            std::unique_ptr<Publisher>& file = outputs.window_files[w * sensors.size() + i];
+            file.reset(new Publisher);
+            if (!file->open(filename, options.publish_method)) {
+                std::cerr << "Cannot open file " << filename << std::endl;
+                exit(1);
+            }
+        }
+    }
+
+    // the intensity estimate goes into the sensor's file name with .now appended
+    outputs.intensity_files.resize(sensors.size());
+
+    for (std::size_t i = 0; options.intensity_period.count() && i < sensors.size(); ++i) {
+        if (sensors.filename(i).empty()) continue;
+        std::string filename = sensors.filename(i) + ".now";
+        outputs.intensity_files[i].reset(new Publisher);
+        if (!outputs.intensity_files[i]->open(filename, options.publish_method)) {
+            std::cerr << "Cannot open file " << filename << std::endl;
+            exit(1);
+        }
+    }
+
+    // the history goes into the sensor's file name with .rrd appended
+    outputs.history.resize(sensors.size());
+
+    for (std::size_t i = 0; options.history && i < sensors.size(); ++i) {
+        if (sensors.filename(i).empty()) continue;
+        std::string filename = sensors.filename(i) + ".rrd";
+        outputs.history[i].reset(new rrd::File);
+        // a gap of more than a few intervals means we were not running
+        int64_t heartbeat = 3 * options.interval.count();
+        if (!outputs.history[i]->open(filename, options.archives, heartbeat, sensors.mm_per_pulse(i))) {
+            std::cerr << "Cannot open file " << filename << " (or it has other archives)" << std::endl;
+            exit(1);
+        }
+    }
+
+    // the pulses per interval go into the sensor's file name with .counts appended
+    outputs.counts.resize(sensors.size());
+
+    for (std::size_t i = 0; options.counts && i < sensors.size(); ++i) {
+        if (sensors.filename(i).empty()) continue;
+        std::string filename = sensors.filename(i) + ".counts";
+        outputs.counts[i].reset(new counts::File);
+        if (!outputs.counts[i]->open(filename, options.interval.count(), sensors.mm_per_pulse(i))) {
+            std::cerr << "Cannot open file " << filename << " (or it has another interval)" << std::endl;
+            exit(1);
+        }
+    }
+
+    if (!options.event_log.empty() && !outputs.log.open(options.event_log)) {
+        std::cerr << "Cannot open file " << options.event_log << std::endl;
+        exit(1);
+    }
+
+    if (!options.shared_memory.empty()
+        && !outputs.shm.create(options.shared_memory, static_cast<uint32_t>(sensors.size()),
+                               static_cast<uint32_t>(sensors.buckets_per_window()), static_cast<uint32_t>(sensors.bucket_width().count()))) {
+        std::cerr << "Cannot create shared memory " << options.shared_memory << std::endl;
+        exit(1);
+    }
+}
+
+
+// continue with the state of the checkpoint file if it matches our configuration,
+// the buckets of the time we were not running stay empty
+
+void restore_checkpoint(const option_t& options, SensorSet& sensors, outputs_t& outputs)
+{
+    if (options.checkpoint.empty()) return;
+
+    // all that determines the layout of the state
+    std::ostringstream layout;
+    layout << sensors.size() << ' ' << sensors.bucket_width().count() << ' ' << sensors.buckets_per_window();
+    for (std::size_t w = 0; w < sensors.windows().windows(); ++w) {
+        const window_spec_t& spec = sensors.windows().spec(w);
+        layout << ' ' << spec.length << ':' << spec.resolution;
+    }
+    layout << ' ';
+    for (std::size_t i = 0; i < options.sensors.size(); ++i) layout << (options.sensors[i].curve ? 'c' : '-');
+    std::string key = layout.str();
+
+    sensors.save(outputs.state);
+    if (!outputs.checkpoint.open(options.checkpoint, outputs.state.size(),
+                                 eventlog::CRC32::compute(reinterpret_cast<const uint8_t*>(key.data()), key.size()))) {
+        std::cerr << "Cannot open file " << options.checkpoint << std::endl;
+        exit(1);
+    }
+
+    std::chrono::milliseconds gap(0);
+    if (!outputs.checkpoint.load(outputs.state)) return;
+    if (!sensors.restore(outputs.state, std::chrono::steady_clock::now(), gap)) {
+        std::cerr << "Ignoring unusable checkpoint " << options.checkpoint << std::endl;
+        return;
+    }
+    std::cerr << "Restored checkpoint " << options.checkpoint << ", no data for the last "
+              << std::setprecision(3) << std::fixed << gap.count() / 1000.0 << " s" << std::endl;
+}
+
+
+// save the state of all sensors into the checkpoint file
+
+void save_checkpoint(const option_t& options, const SensorSet& sensors, outputs_t& outputs)
+{
+    if (!outputs.checkpoint.is_open()) return;
+
+    outputs.state.clear();
+    sensors.save(outputs.state);
+    bool sync = options.checkpoint_sync && ++outputs.checkpoints % options.checkpoint_sync == 0;
+    if (!outputs.checkpoint.save(outputs.state, sync)) {
+        std::cerr << "Cannot write checkpoint " << options.checkpoint << std::endl;
+    }
+}
+
+
+// write the current rainfall of one sensor to its file and the console
+
+void publish(const option_t& options, const SensorSet& sensors, outputs_t& outputs, std::size_t i)
+{
+    double mm_per_hour = sensors.mm_per_hour(i);
+
+    if (outputs.files[i] && !outputs.files[i]->publish(mm_per_hour)) {
+        std::cerr << "Cannot write file " << outputs.files[i]->filename() << std::endl;
+        exit(1);
+    }
+
+    if (outputs.shm.is_open()) {
+        rainshm::snapshot_t values;
+        values.mm_per_hour = mm_per_hour;
+        values.total_events = sensors.total_events(i);
+        values.total_mm = sensors.total_rainfall(i);
+        values.last_tip = values.total_events ? outputs.epoch_time(sensors.last_tip(i)) : 0;
+        values.ring_position = static_cast<uint32_t>(sensors.current_bucket());
+        outputs.shm.update(i, values, sensors.bucket_row(0) + i, sensors.size(), sensors.buckets_started());
+    }
+
+    if (options.print_to_console) {
+
+        // only name the sensor if there is more than one
+        if (sensors.size() > 1) outputs.console.append("sensor ").append(i).append(": ");
+        outputs.console.append_fixed(mm_per_hour, 2).append(" mm/m2\n");
+
+    }
+}
+
+
+// write the rainfall within the rolling windows, after an interval was closed
+
+void publish_windows(const option_t& options, const SensorSet& sensors, outputs_t& outputs)
+{
+    const WindowCascade& windows = sensors.windows();
+
+    for (std::size_t w = 0; w < windows.windows(); ++w) {
+        const unsigned long* sums = windows.sums(w);
+        for (std::size_t i = 0; i < sensors.size(); ++i) {
+            std::unique_ptr<Publisher>& file = outputs.window_files[w * sensors.size() + i];
+            if (file && !file->publish(sensors.rainfall(i, sums[i]))) {
+                std::cerr << "Cannot write file " << file->filename() << std::endl;
+                exit(1);
+            }
+        }
+    }
+
+    if (options.print_to_console && windows.windows()) {
+        for (std::size_t i = 0; i < sensors.size(); ++i) {
+            if (sensors.size() > 1) outputs.console.append("sensor ").append(i).append(": ");
+            for (std::size_t w = 0; w < windows.windows(); ++w) {
+                if (w) outputs.console.append(", ");
+                const std::string& label = windows.spec(w).label;
+                outputs.console.append(label.data(), label.size()).append(": ")
+                               .append_fixed(sensors.rainfall(i, windows.sums(w)[i]), 2).append(" mm");
+            }
+            outputs.console.append("\n");
+        }
+    }
+}
+
+
+// write the rain rate estimated from the time between tips
+
+void publish_intensity(const option_t& options, const SensorSet& sensors, outputs_t& outputs, std::chrono::steady_clock::time_point now)
+{
+    for (std::size_t i = 0; i < sensors.size(); ++i) {
+        double intensity = sensors.intensity(i, now);
+
+        if (outputs.intensity_files[i] && !outputs.intensity_files[i]->publish(intensity)) {
+            std::cerr << "Cannot write file " << outputs.intensity_files[i]->filename() << std::endl;
+            exit(1);
+        }
+
+        if (options.print_to_console) {
+            if (sensors.size() > 1) outputs.console.append("sensor ").append(i).append(": ");
+            outputs.console.append_fixed(intensity, 2).append(" mm/h now\n");
+        }
+    }
+}
+
+
+// add the pulses since the last update to the history and counts files
+
+void update_history(const SensorSet& sensors, outputs_t& outputs, std::chrono::steady_clock::time_point now)
+{
+    int64_t time = outputs.epoch_time(now) / 1000;
+
+    for (std::size_t i = 0; i < sensors.size(); ++i) {
+        unsigned long events = sensors.total_events(i) - outputs.history_events[i];
+        outputs.history_events[i] = sensors.total_events(i);
+        if (outputs.history[i]) outputs.history[i]->update(time, events);
+        // the pulses counted up to now belong to the interval that ends now
+        if (outputs.counts[i] && !outputs.counts[i]->add(time - 1, events)) {
+            std::cerr << "Cannot write to counts of sensor " << i << std::endl;
+        }
+    }
+}
+
+
+// append the pulses of the last poll() to the event log
+
+void log_events(const SensorSet& sensors, std::chrono::steady_clock::time_point now, eventlog::Writer& log)
+{
+    if (!log.is_open()) return;
+
+    const std::vector<std::size_t>& changed = sensors.changed();
+    for (std::vector<std::size_t>::const_iterator it = changed.begin(); it != changed.end(); ++it) {
+        if (!log.add(static_cast<uint32_t>(*it), now, sensors.new_events(*it))) {
+            std::cerr << "Cannot write to event log" << std::endl;
+        }
+    }
+}
+
+
+// print the wakeup lateness of the updates and how the sensors that
+// debounce themselves are doing
+
+void print_lateness(Scheduler& scheduler, const SensorSet& sensors)
+{
+    scheduler.lateness().print(std::cerr);
+    scheduler.lateness().reset();
+
+    for (std::size_t i = 0; i < sensors.size(); ++i) {
+        uint64_t accepted, rejected;
+        std::chrono::microseconds settle;
+        if (!sensors.source(i).debounce_counts(accepted, rejected, settle)) continue;
+        std::cerr << "sensor " << i << ": " << accepted << " edges accepted, " << rejected
+                  << " rejected as bounces, settle time " << settle.count() / 1000.0 << " ms" << std::endl;
+    }
+}
+
+
+// and that once an hour, if asked to
+
+void report_lateness(const option_t& options, Scheduler& scheduler, const SensorSet& sensors)
+{
+    if (!options.print_lateness) return;
+
+    uint64_t per_hour = static_cast<uint64_t>(std::chrono::milliseconds(std::chrono::hours(1)).count() / options.interval.count());
+    if (scheduler.lateness().count() + scheduler.lateness().missed() < std::max<uint64_t>(per_hour, 1)) return;
+
+    print_lateness(scheduler, sensors);
+}
+
+
+// tell when the capture thread had to hold back pulses because the main
+// loop did not take them in time
+
+void report_overflows(const PulseCapture& capture, outputs_t& outputs)
+{
+    uint64_t overflows = capture.overflows();
+    if (overflows == outputs.capture_overflows) return;
+    std::cerr << "pulse capture queues overflowed " << overflows - outputs.capture_overflows << " times, pulses were delayed" << std::endl;
+    outputs.capture_overflows = overflows;
+}
+
+
+// set up the rolling windows of -W, after all sensors were added
+
+void configure_windows(const option_t& options, SensorSet& sensors)
+{
+    std::string error;
+    if (!sensors.windows().configure(options.windows, static_cast<unsigned long>(options.bucket_width.count()), sensors.size(), error)) {
+        std::cerr << error << std::endl;
+        exit(1);
+    }
+}
+
+
+// a unix socket that answers every connection with the current rainfall
+// of all sensors, one line each
+
+int open_control_socket(const std::string& path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Cannot open socket " << path << ": name too long" << std::endl;
+        exit(1);
+    }
+    strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+    // the socket of an earlier run is in the way
+    unlink(path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0
+        || bind(fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) != 0
+        || listen(fd, 16) != 0
+        || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0
+        || fcntl(fd, F_SETFD, FD_CLOEXEC) != 0) {
+        std::cerr << "Cannot open socket " << path << ": " << strerror(errno) << std::endl;
+        exit(1);
+    }
+
+    // a client that hangs up early must not take us down
+    signal(SIGPIPE, SIG_IGN);
+    return fd;
+}
+
+
+// answer all waiting connections. The loop does not wait for a client,
+// a reply that does not fit into the socket buffer is cut
 
-#include <string>
-#include <vector>
-#include <iostream>
-#include <fstream>
-#include <iomanip>
-#include <chrono>
+void answer_queries(int listener, const SensorSet& sensors, outputs_t& outputs)
+{
+    int client;
+    while ((client = accept(listener, nullptr, nullptr)) >= 0) {
+        fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+        outputs.reply.set_fd(client);
+        for (std::size_t i = 0; i < sensors.size(); ++i) {
+            outputs.reply.append("sensor ").append(i).append(": ");
+            outputs.reply.append_fixed(sensors.mm_per_hour(i), 2).append(" mm/h, ");
+            outputs.reply.append_fixed(sensors.total_rainfall(i), 2).append(" mm total, ");
+            outputs.reply.append(sensors.total_events(i)).append(" tips\n");
+        }
+        outputs.reply.flush();
+        close(client);
+    }
+}
 
-#include <cppgpio.hpp>
 
+// the deadlines of the main loop and the reactor that waits for them
 
-// keep the startup options in a struct
+struct loop_t {
+    loop_t(const option_t& options) : scheduler(options.interval), intensity(options.intensity_period) {}
 
-struct option_t {
-    std::string filename;
-    bool print_to_console = false;
-    int interval = 5;
-    int gpio_pin = 0;
-    int milliliter = 5;
-    int sqcm = 127; // exact value of default device is 127.455166;
+    Scheduler scheduler; // the updates
+    Scheduler intensity; // the intensity estimate of -I
+    Reactor reactor;
+    std::size_t update_timer = Reactor::none;
+    std::size_t intensity_timer = Reactor::none;
+    std::size_t poll_timer = Reactor::none; // for the sources without a descriptor with -e
 };
 
+const std::size_t all_sensors = static_cast<std::size_t>(-1);
+
+
+// read the new pulses of one sensor or of all. With -e they are published
+// at once, otherwise at the end of the interval
+
+void read_pulses(const option_t& options, SensorSet& sensors, outputs_t& outputs, std::size_t sensor)
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    // the pulses belong to the bucket we are in now
+    sensors.advance_to(now);
+    std::size_t changed = sensor == all_sensors ? sensors.poll(now) : sensors.poll(sensor, now);
+    if (!changed) return;
+
+    log_events(sensors, now, outputs.log);
+    if (!options.event_poll) return;
+
+    const std::vector<std::size_t>& sensor_list = sensors.changed();
+    for (std::vector<std::size_t>::const_iterator it = sensor_list.begin(); it != sensor_list.end(); ++it) {
+        sensors.update_rate(*it, now);
+        publish(options, sensors, outputs, *it);
+    }
+    outputs.console.flush();
+}
+
+
+// publish the intensity estimate of -I, the rates decay between tips, so
+// they are published on their own clock
+
+void estimate_intensity(const option_t& options, SensorSet& sensors, outputs_t& outputs, loop_t& loop, bool flush)
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    // between the intervals the counters are read for the estimate, their
+    // pulses go into the buckets as usual
+    sensors.advance_to(now);
+    if (!options.event_poll && sensors.poll(now)) log_events(sensors, now, outputs.log);
+
+    publish_intensity(options, sensors, outputs, now);
+    if (flush) outputs.console.flush();
+    loop.intensity.arrived(now);
+    loop.reactor.arm(loop.intensity_timer, loop.intensity.deadline());
+}
+
+
+// the end of an interval: update and publish all sensors, also those
+// without new pulses, so that rates decay when it stops raining
+
+void update(const option_t& options, SensorSet& sensors, outputs_t& outputs, loop_t& loop, const PulseCapture& capture,
+            std::chrono::steady_clock::time_point now)
+{
+    loop.scheduler.arrived(now);
+
+    if (options.event_poll) {
+        sensors.advance_to(now);
+        sensors.poll(now);
+        log_events(sensors, now, outputs.log);
+        for (std::size_t i = 0; i < sensors.size(); ++i) sensors.update_rate(i, now);
+    } else {
+        // read all counters and update the buckets
+        sensors.tick(now);
+        log_events(sensors, now, outputs.log);
+    }
+
+    if (outputs.log.is_open() && !outputs.log.flush()) std::cerr << "Cannot write to event log " << options.event_log << std::endl;
+    if (outputs.edges && !outputs.edges->flush()) std::cerr << "Cannot write to edge log " << options.edge_log << std::endl;
+
+    for (std::size_t i = 0; i < sensors.size(); ++i) {
+        publish(options, sensors, outputs, i);
+    }
+    publish_windows(options, sensors, outputs);
+    if (options.intensity_period.count() && now >= loop.intensity.deadline()) {
+        estimate_intensity(options, sensors, outputs, loop, false);
+    }
+    // all lines of the update with a single write
+    outputs.console.flush();
+    update_history(sensors, outputs, now);
+    save_checkpoint(options, sensors, outputs);
+    report_overflows(capture, outputs);
+    report_lateness(options, loop.scheduler, sensors);
+}
+
 
-// the main loop for the rain sensor runs forever
+// the main loop for the rain sensors runs until SIGINT or SIGTERM. A single
+// thread waits for all that can happen at once: the deadlines, the sources
+// with a descriptor, the signals and the control socket. SIGUSR1 prints
+// the wakeup statistics
 
 void count_rain(const option_t& options)
 {
-    // setup the Counter object with very conservative values for the debouncing
-    GPIO::Counter counter(options.gpio_pin, GPIO::GPIO_PULL::UP, std::chrono::milliseconds(500), std::chrono::milliseconds(5));
-    // and start counting
-    counter.start();
+    std::string error;
+    loop_t loop(options);
 
-    typedef std::vector<unsigned long> bucket_vec_t;
-    bucket_vec_t buckets;
-    // assign zeroes to all buckets and make them index accessible
-    buckets.resize(60 / options.interval);
-    bucket_vec_t::iterator inserter = buckets.begin();
-    
-    // init with current counter value (probably 0)
-    unsigned long last_event_counter = counter.get_count();
+    // the raw edges, outliving the sources that record into it
+    edgelog::Writer edges;
+    if (!options.edge_log.empty() && !edges.open(options.edge_log)) {
+        std::cerr << "Cannot open file " << options.edge_log << std::endl;
+        exit(1);
+    }
 
-    while (true) {
-        
-        // sleep some minutes
-        std::this_thread::sleep_for(std::chrono::seconds(options.interval * 60));
+    SensorSet sensors(options.bucket_width);
 
-        // get new counter value
-        unsigned long new_event_counter = counter.get_count();
-        
-        // did we have an overflow? then start counting again at 0
-        // (this is a simplified solution, we could also add the amount of the max
-        // data type minus the last counter to the new counter value, which would get us
-        // the true event count. But this happens every some years of uninterrupted
-        // runtime, so why bother)
-        if (new_event_counter < last_event_counter) last_event_counter = 0;
-        
-        // calculate number of new events during this interval
-        unsigned long events = new_event_counter - last_event_counter;
-        
-        // and store the new counter value for the next round
-        last_event_counter = new_event_counter;
-        
-        // store it in the bucket vector
-        *inserter++ = events;
-        
-        // check if the bucket vector is full and we have to start at the begin
-        if (inserter == buckets.end()) inserter = buckets.begin();
-        
-        unsigned long events_per_hour = 0;
-        for (bucket_vec_t::iterator it = buckets.begin(); it != buckets.end(); ++it) {
-            events_per_hour += *it;
+    // before any source or thread is started, so that the signals reach the reactor
+    bool ok = loop.reactor.open(error);
+    ok = ok && loop.reactor.catch_signal(SIGINT, [&]() { loop.reactor.stop(); }, error);
+    ok = ok && loop.reactor.catch_signal(SIGTERM, [&]() { loop.reactor.stop(); }, error);
+    ok = ok && loop.reactor.catch_signal(SIGUSR1, [&]() {
+        print_lateness(loop.scheduler, sensors);
+        std::cerr << "main loop: " << loop.reactor.wakeups() << " wakeups" << std::endl;
+    }, error);
+    if (!ok) {
+        std::cerr << error << std::endl;
+        exit(1);
+    }
+
+    // stopped before the sensors go away, they own its queues
+    PulseCapture capture(std::chrono::milliseconds(options.event_poll ? options.event_poll : 1), options.capture_cpu);
+
+    for (std::size_t i = 0; i < options.sensors.size(); ++i) {
+        std::unique_ptr<PulseSource> source = make_pulse_source(options, options.sensors[i], i, edges.is_open() ? &edges : nullptr);
+        if (options.capture) source = capture.add(std::move(source));
+        sensors.add(options.sensors[i], std::move(source));
+    }
+
+    configure_windows(options, sensors);
+
+    outputs_t outputs;
+    open_outputs(options, sensors, outputs);
+    // the capture thread writes the edges itself when its batches are full
+    if (edges.is_open() && !options.capture) outputs.edges = &edges;
+
+    // start counting, where we stopped if there is a checkpoint
+    sensors.start();
+    restore_checkpoint(options, sensors, outputs);
+    for (std::size_t i = 0; i < sensors.size(); ++i) outputs.history_events.push_back(sensors.total_events(i));
+
+    // the sources with a descriptor are read when they have pulses, the
+    // captured ones all at once when the capture thread queued some
+    bool polled = false;
+    if (options.capture && capture.fd() >= 0) {
+        ok = ok && loop.reactor.watch(capture.fd(), [&]() {
+            capture.acknowledge();
+            read_pulses(options, sensors, outputs, all_sensors);
+        }, error);
+    }
+    for (std::size_t i = 0; i < sensors.size(); ++i) {
+        if (sensors.source(i).fd() < 0) polled = true;
+        else if (!options.capture) ok = ok && loop.reactor.watch(sensors.source(i).fd(), [&, i]() { read_pulses(options, sensors, outputs, i); }, error);
+    }
+
+    loop.update_timer = loop.reactor.add_timer([&]() {
+        update(options, sensors, outputs, loop, capture, std::chrono::steady_clock::now());
+        loop.reactor.arm(loop.update_timer, loop.scheduler.deadline());
+    }, error);
+    ok = ok && loop.update_timer != Reactor::none;
+    if (options.intensity_period.count()) {
+        loop.intensity_timer = loop.reactor.add_timer([&]() { estimate_intensity(options, sensors, outputs, loop, true); }, error);
+        ok = ok && loop.intensity_timer != Reactor::none;
+    }
+    // the others are polled with -e, without it their counters are read at the updates
+    if (options.event_poll && polled) {
+        loop.poll_timer = loop.reactor.add_timer([&]() {
+            read_pulses(options, sensors, outputs, all_sensors);
+            loop.reactor.arm(loop.poll_timer, sensors.next_poll(std::chrono::steady_clock::now()));
+        }, error);
+        ok = ok && loop.poll_timer != Reactor::none;
+    }
+
+    int control = options.control_socket.empty() ? -1 : open_control_socket(options.control_socket);
+    if (control >= 0) ok = ok && loop.reactor.watch(control, [&]() { answer_queries(control, sensors, outputs); }, error);
+
+    if (!ok) {
+        std::cerr << error << std::endl;
+        exit(1);
+    }
+
+    if (options.capture && !capture.start()) {
+        std::cerr << "Cannot pin the capture thread to cpu " << options.capture_cpu << std::endl;
+    }
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    loop.reactor.arm(loop.update_timer, loop.scheduler.deadline());
+    if (loop.intensity_timer != Reactor::none) loop.reactor.arm(loop.intensity_timer, loop.intensity.deadline());
+    if (loop.poll_timer != Reactor::none) loop.reactor.arm(loop.poll_timer, sensors.next_poll(now));
+
+    loop.reactor.run();
+
+    // leave complete files behind
+    capture.stop();
+    if (outputs.log.is_open()) outputs.log.flush();
+    if (outputs.edges) outputs.edges->flush();
+    save_checkpoint(options, sensors, outputs);
+    if (control >= 0) {
+        close(control);
+        unlink(options.control_socket.c_str());
+    }
+}
+
+
+// the replay of one sensor of an event log
+
+struct replay_t {
+    std::size_t log = 0;
+    uint32_t sensor = 0;
+    std::vector<std::pair<int64_t, unsigned long> > events;
+    unsigned long pulses = 0;
+    double total_mm = 0;
+    double max_mm_per_hour = 0;
+    int64_t max_time = 0;
+    std::string updates; // the updates of every interval with -p
+};
+
+
+// run the recorded pulses of one sensor through the interval aggregation
+// of count_rain(), on a virtual clock instead of sleeping
+
+void replay_sensor(const option_t& options, replay_t& replay)
+{
+    if (replay.events.empty()) return;
+
+    VirtualClock clock;
+    ReplayPulseSource* source = new ReplayPulseSource(clock);
+    for (std::size_t e = 0; e < replay.events.size(); ++e) source->add(replay.events[e].first, replay.events[e].second);
+
+    // the calibration of the sensor, or the one of the command line
+    sensor_option_t sensor;
+    sensor.milliliter = options.milliliter;
+    sensor.micro_sqcm = options.micro_sqcm;
+    sensor.curve = options.curve;
+    if (replay.sensor < options.sensors.size()) sensor = options.sensors[replay.sensor];
+
+    SensorSet sensors(options.bucket_width);
+    sensors.add(sensor, std::unique_ptr<PulseSource>(source));
+    configure_windows(options, sensors);
+
+    // buckets and deadlines aligned to the clock, like when it was recorded
+    const int64_t width = options.bucket_width.count() * 1000;
+    const int64_t interval = options.interval.count() * 1000;
+    source->start();
+    int64_t first = source->first();
+    int64_t last = source->last();
+    sensors.start(VirtualClock::from_epoch((first / width + 1) * width));
+
+    std::ostringstream updates;
+    const WindowCascade& windows = sensors.windows();
+
+    // run until the last pulse has left the hour
+    for (int64_t deadline = (first / interval + 1) * interval; deadline <= last + 3600000000LL + interval; deadline += interval) {
+        std::chrono::steady_clock::time_point now = VirtualClock::from_epoch(deadline);
+        clock.set(now);
+        sensors.tick(now);
+
+        double mm_per_hour = sensors.mm_per_hour(0);
+        if (mm_per_hour > replay.max_mm_per_hour) {
+            replay.max_mm_per_hour = mm_per_hour;
+            replay.max_time = deadline;
         }
-        
-        double mm_per_hour = events_per_hour * options.sqcm * options.milliliter / 1000;
-        
-        if (!options.filename.empty()) {
-            
-            std::ofstream out;
-            out.open(options.filename.c_str(), std::ofstream::out | std::ofstream::trunc);
 
-            if (!out.is_open()) {
-                std::cerr << "Cannot open file " << options.filename << std::endl;
+        if (options.print_to_console) {
+            updates << deadline / 1000000 << ' ' << replay.sensor << ' ' << std::setprecision(2) << std::fixed << mm_per_hour;
+            for (std::size_t w = 0; w < windows.windows(); ++w) updates << ' ' << sensors.rainfall(0, windows.sums(w)[0]);
+            updates << '\n';
+        }
+    }
+
+    replay.pulses = sensors.total_events(0);
+    replay.total_mm = sensors.total_rainfall(0);
+    replay.updates = updates.str();
+    replay.events.clear();
+}
+
+
+// replay event logs: load them, then replay every sensor of every log, all
+// in parallel, and print the results in a fixed order
+
+void replay_event_logs(const option_t& options)
+{
+    WorkStealingPool pool(static_cast<unsigned int>(options.threads));
+    std::vector<std::vector<replay_t> > replays(options.replay.size());
+
+    for (std::size_t l = 0; l < options.replay.size(); ++l) {
+        pool.add([&options, &replays, l]() {
+            eventlog::Reader reader;
+            if (!reader.open(options.replay[l])) {
+                std::cerr << "Cannot open file " << options.replay[l] << std::endl;
                 exit(1);
             }
+            std::vector<replay_t>& sensors = replays[l];
+            reader.for_each([&sensors, l](const eventlog::entry_t& entry) {
+                if (entry.sensor >= sensors.size()) sensors.resize(entry.sensor + 1);
+                sensors[entry.sensor].events.push_back(std::make_pair(entry.time, static_cast<unsigned long>(entry.pulses)));
+            });
+            for (std::size_t i = 0; i < sensors.size(); ++i) {
+                sensors[i].log = l;
+                sensors[i].sensor = static_cast<uint32_t>(i);
+            }
+        });
+    }
+    pool.run();
+
+    for (std::size_t l = 0; l < replays.size(); ++l) {
+        for (std::size_t i = 0; i < replays[l].size(); ++i) {
+            replay_t* replay = &replays[l][i];
+            pool.add([&options, replay]() { replay_sensor(options, *replay); });
+        }
+    }
+    pool.run();
+
+    for (std::size_t l = 0; l < replays.size(); ++l) {
+        for (std::size_t i = 0; i < replays[l].size(); ++i) {
+            const replay_t& replay = replays[l][i];
+            if (!replay.pulses) continue;
+            std::cout << "# " << options.replay[l] << " sensor " << i << ": " << replay.pulses << " pulses, "
+                      << std::setprecision(2) << std::fixed << replay.total_mm << " mm, max "
+                      << replay.max_mm_per_hour << " mm/m2 at " << replay.max_time / 1000000 << std::endl;
+            std::cout << replay.updates;
+        }
+    }
+}
+
+
+// print the entries of an event log as text: time (seconds since the epoch), sensor, pulses
+
+void dump_event_log(const std::string& filename)
+{
+    eventlog::Reader reader;
+
+    if (!reader.open(filename)) {
+        std::cerr << "Cannot open file " << filename << std::endl;
+        exit(1);
+    }
+
+    reader.for_each([](const eventlog::entry_t& entry) {
+        std::cout << entry.time / 1000000 << '.' << std::setw(6) << std::setfill('0') << entry.time % 1000000
+                  << std::setfill(' ') << ' ' << entry.sensor << ' ' << entry.pulses << '\n';
+    });
+
+    if (reader.damaged()) std::cerr << reader.damaged() << " damaged blocks skipped" << std::endl;
+}
+
+
+// print the known rows of all archives of a history file: time (seconds since the epoch), rainfall
+
+void dump_history(const std::string& filename)
+{
+    rrd::File history;
+
+    if (!history.open(filename)) {
+        std::cerr << "Cannot open file " << filename << std::endl;
+        exit(1);
+    }
+
+    for (std::size_t a = 0; a < history.archives(); ++a) {
+        rrd::archive_spec_t spec = history.archive_spec(a);
+        std::cout << "# step " << spec.step << " ms, " << spec.rows << " rows" << std::endl;
+
+        // the rows of the archive, oldest first: for its own range and
+        // step fetch picks this archive
+        int64_t end = (history.last_update() + spec.step - 1) / spec.step * spec.step;
+        rrd::fetch_t rows;
+        if (!history.last_update() || !history.fetch(end - spec.step * static_cast<int64_t>(spec.rows), end, spec.step, rows)) continue;
+
+        for (std::size_t r = 0; r < rows.values.size(); ++r) {
+            if (std::isnan(rows.values[r])) continue;
+            std::cout << (rows.start + r * rows.step) / 1000 << ' ' << std::setprecision(3) << std::fixed << rows.values[r] << '\n';
+        }
+    }
+}
+
+
+// sweep fixed settle times over a recording of raw edges and print how
+// many edges each would accept, per sensor. Bounces are much closer than
+// tips, so the counts level off between the two: that plateau gives the
+// limits for -B
+
+void analyze_edges(const option_t& options)
+{
+    std::vector<std::vector<int64_t> > times;
+    if (!edgelog::load(options.edge_analysis, times)) {
+        std::cerr << "Cannot open file " << options.edge_analysis << std::endl;
+        exit(1);
+    }
+
+    static const int64_t settles[] = { 1, 2, 3, 4, 5, 6, 8, 10, 12, 15, 20, 25, 30, 40, 50, 60, 80, 100,
+                                       120, 150, 200, 250, 300, 400, 500, 600, 800, 1000 }; // ms
+    const std::size_t count = sizeof(settles) / sizeof(settles[0]);
+
+    // the gaps between the edges of every sensor, in microseconds
+    std::vector<std::vector<int64_t> > gaps(times.size());
+    std::vector<std::vector<uint64_t> > accepted(times.size(), std::vector<uint64_t>(count, 0));
+
+    WorkStealingPool pool(static_cast<unsigned int>(options.threads));
+    for (std::size_t i = 0; i < times.size(); ++i) {
+        pool.add([&times, &gaps, i]() {
+            std::vector<int64_t>& t = times[i];
+            // runs that were appended may overlap a little
+            std::sort(t.begin(), t.end());
+            if (t.size() > 1) {
+                gaps[i].resize(t.size() - 1);
+                for (std::size_t e = 1; e < t.size(); ++e) gaps[i][e - 1] = t[e] - t[e - 1];
+            }
+        });
+    }
+    pool.run();
 
-            out << std::setprecision(2) << std::fixed << mm_per_hour << std::endl;
+    for (std::size_t i = 0; i < times.size(); ++i) {
+        for (std::size_t k = 0; k < count && !times[i].empty(); ++k) {
+            pool.add([&gaps, &accepted, i, k]() {
+                // the first edge is always accepted
+                accepted[i][k] = 1 + count_quiet(gaps[i].data(), gaps[i].size(), settles[k] * 1000);
+            });
+        }
+    }
+    pool.run();
 
-            out.close();
+    for (std::size_t i = 0; i < times.size(); ++i) {
+        if (times[i].empty()) continue;
+        const std::vector<uint64_t>& a = accepted[i];
+        std::cout << "sensor " << i << ": " << times[i].size() << " edges" << std::endl;
+        for (std::size_t k = 0; k < count; ++k) {
+            std::cout << std::setw(8) << settles[k] << " ms " << std::setw(12) << a[k] << " accepted "
+                      << std::setw(12) << times[i].size() - a[k] << " rejected" << std::endl;
+        }
 
+        // the flattest spot, and how far the counts stay within half a percent of it
+        std::size_t best = 1;
+        for (std::size_t k = 1; k + 1 < count; ++k) {
+            if ((a[k - 1] - a[k + 1]) * a[best] < (a[best - 1] - a[best + 1]) * a[k]) best = k;
         }
-        
-        if (options.print_to_console) {
-            
-            std::cout << std::setprecision(2) << std::fixed << mm_per_hour << " mm/m2" << std::endl;
-            
+        std::size_t first = best, last = best;
+        while (first > 0 && (a[first - 1] - a[best]) * 200 <= a[best]) --first;
+        while (last + 1 < count && (a[best] - a[last + 1]) * 200 <= a[best]) ++last;
+        std::cout << "sensor " << i << ": " << a[best] << " pulses, use -B min=" << settles[first] << "ms,max=" << settles[last] << "ms" << std::endl;
+    }
+}
+
+
+// the calibration of a sensor, or the one of the command line
+
+double mm_per_pulse(const option_t& options, std::size_t sensor)
+{
+    if (sensor < options.sensors.size()) return fixedpoint::Calibration(options.sensors[sensor].micro_sqcm, static_cast<uint64_t>(options.sensors[sensor].milliliter)).mm_per_pulse();
+    return fixedpoint::Calibration(options.micro_sqcm, static_cast<uint64_t>(options.milliliter)).mm_per_pulse();
+}
+
+
+// answer a query on the event log or a counts file, spec is a comma
+// separated list of sensor=N, from=T, to=T (seconds since the epoch),
+// optionally window=duration for the largest total within aligned windows
+// of that length, and counts=file to read a counts file instead of the log
+
+void query_event_log(const option_t& options)
+{
+    key_value_vec_t pairs;
+    double sensor = 0, from = 0, to = 0;
+    uint64_t window = 0;
+    std::string counts_file;
+    bool valid = split_key_values(options.query, pairs);
+
+    for (key_value_vec_t::const_iterator it = pairs.begin(); valid && it != pairs.end(); ++it) {
+        if (it->first == "window") valid = parse_long_duration(it->second, window);
+        else if (it->first == "counts") counts_file = it->second;
+        else if (it->first == "sensor") valid = parse_number(it->second, sensor);
+        else if (it->first == "from") valid = parse_number(it->second, from);
+        else if (it->first == "to") valid = parse_number(it->second, to);
+        else valid = false;
+    }
+    if (!valid || to <= from || (options.event_log.empty() && counts_file.empty())) {
+        std::cerr << "invalid query (needs -l or counts=file, and sensor=N,from=T,to=T[,window=D]): " << options.query << std::endl;
+        exit(1);
+    }
+
+    std::size_t index = static_cast<std::size_t>(sensor);
+    double per_pulse = mm_per_pulse(options, index);
+    uint64_t pulses = 0, max_pulses = 0;
+    int64_t max_start = 0;
+
+    if (!counts_file.empty()) {
+        // the counts file is in milliseconds and knows its calibration
+        counts::File counts;
+        if (!counts.open(counts_file, 0, 0, true)) {
+            std::cerr << "Cannot open file " << counts_file << std::endl;
+            exit(1);
         }
-        
+        int64_t from_ms = static_cast<int64_t>(from * 1000 + 0.5);
+        int64_t to_ms = static_cast<int64_t>(to * 1000 + 0.5);
+        per_pulse = counts.mm_per_pulse();
+        pulses = counts.total(from_ms, to_ms);
+        if (window) max_pulses = counts.max_window(from_ms, to_ms, static_cast<int64_t>(window), max_start);
+        max_start *= 1000;
+    } else {
+        eventlog::IndexedLog log;
+        if (!log.open(options.event_log)) {
+            std::cerr << "Cannot open file " << options.event_log << std::endl;
+            exit(1);
+        }
+        int64_t from_us = static_cast<int64_t>(from * 1000000 + 0.5);
+        int64_t to_us = static_cast<int64_t>(to * 1000000 + 0.5);
+        pulses = log.total(static_cast<uint32_t>(index), from_us, to_us);
+        if (window) max_pulses = log.max_window(static_cast<uint32_t>(index), from_us, to_us, static_cast<int64_t>(window) * 1000, max_start);
+    }
+
+    std::cout << "total: " << pulses << " pulses, " << std::setprecision(2) << std::fixed << pulses * per_pulse << " mm" << std::endl;
+    if (window) {
+        std::cout << "max window: " << max_pulses << " pulses, " << max_pulses * per_pulse << " mm, from "
+                  << max_start / 1000000 << std::endl;
+    }
+}
+
+
+// correct the pulses of one interval in a counts file, spec is
+// counts=file,at=T,pulses=N (T in seconds since the epoch)
+
+void patch_counts(const option_t& options)
+{
+    key_value_vec_t pairs;
+    double at = -1, pulses = -1;
+    std::string counts_file;
+    bool valid = split_key_values(options.patch, pairs);
+
+    for (key_value_vec_t::const_iterator it = pairs.begin(); valid && it != pairs.end(); ++it) {
+        if (it->first == "counts") counts_file = it->second;
+        else if (it->first == "at") valid = parse_number(it->second, at);
+        else if (it->first == "pulses") valid = parse_number(it->second, pulses);
+        else valid = false;
+    }
+    if (!valid || counts_file.empty() || at < 0 || pulses < 0) {
+        std::cerr << "invalid patch (needs counts=file,at=T,pulses=N): " << options.patch << std::endl;
+        exit(1);
+    }
+
+    // keep the interval and calibration the file has
+    counts::File counts;
+    if (!counts.open(counts_file, 0, 0, true)) {
+        std::cerr << "Cannot open file " << counts_file << std::endl;
+        exit(1);
+    }
+    int64_t interval = counts.interval();
+    double per_pulse = counts.mm_per_pulse();
+
+    if (!counts.open(counts_file, interval, per_pulse)
+        || !counts.set(static_cast<int64_t>(at * 1000 + 0.5), static_cast<uint64_t>(pulses))) {
+        std::cerr << "Cannot write to " << counts_file << std::endl;
+        exit(1);
     }
 }
 
 
 // read options and start main loop
 
+#ifndef RAINSENSOR_NO_MAIN
+
 int main(int argc, char *argv[])
 {
     // analyze options
@@ -129,8 +1423,21 @@ int main(int argc, char *argv[])
     {
         int opt;
         
-        while ((opt = getopt(argc, argv, "b:c:f:hi:p:s:")) != -1) {
+        while ((opt = getopt(argc, argv, "A:B:b:Cc:Dd:E:e:F:f:g:HhI:i:j:K:k:l:M:m:n:P:pQ:R:r:S:s:T:t:U:W:w:X:")) != -1) {
             switch (opt) {
+                case 'A':
+                    options.archives.clear();
+                    if (!parse_archives(optarg, options.archives)) {
+                        std::cerr << "invalid archives: " << optarg << std::endl;
+                        exit(1);
+                    }
+                    break;
+                case 'B':
+                    if (!parse_debounce(optarg, options.debounce)) {
+                        std::cerr << "invalid debounce: " << optarg << std::endl;
+                        exit(1);
+                    }
+                    break;
                 case 'b':
                     options.milliliter = atoi(optarg);
                     if (options.milliliter < 1 || options.milliliter > 1000) {
@@ -138,6 +1445,9 @@ int main(int argc, char *argv[])
                         exit(1);
                     }
                     break;
+                case 'C':
+                    options.counts = true;
+                    break;
                 case 'c':
                     options.gpio_pin = atoi(optarg);
                     if (options.gpio_pin < 0 || options.gpio_pin > 63) {
@@ -145,35 +1455,241 @@ int main(int argc, char *argv[])
                         exit(1);
                     }
                     break;
+                case 'D':
+                    options.history = true;
+                    break;
+                case 'd':
+                    dump_event_log(optarg);
+                    exit(0);
+                case 'E':
+                    options.edge_log = optarg;
+                    break;
+                case 'F':
+                    dump_history(optarg);
+                    exit(0);
+                case 'H':
+                    options.print_lateness = true;
+                    break;
+                case 'e':
+                    options.event_poll = atoi(optarg);
+                    if (options.event_poll < 1 || options.event_poll > 1000) {
+                        std::cerr << "invalid value for event poll interval (1..1000): " << options.event_poll << std::endl;
+                        exit(1);
+                    }
+                    break;
                 case 'f':
                     options.filename = optarg;
                     break;
+                case 'g':
+                    options.gpio_chip = optarg;
+                    break;
                 default:
                 case 'h':
                     std::cout << argv[0] << " - help:" << std::endl;
                     std::cout << std::endl;
+                    std::cout << " -A list  : the archives of the history files, step:length in ms, s, m, h" << std::endl;
+                    std::cout << "            or d (default 1m:2d,10m:60d,1h:3650d)" << std::endl;
+                    std::cout << " -B spec  : limits of the debouncing that learns the settle time of the" << std::endl;
+                    std::cout << "            contacts, spec is min=D,max=D (ms or s, default 2ms and 500ms)," << std::endl;
+                    std::cout << "            margin=N over the longest bounce (default 2) and gap=D, the" << std::endl;
+                    std::cout << "            longest quiet time within a bounce (default 25ms)" << std::endl;
                     std::cout << " -b N     : milliliter per bucket count (default 5)" << std::endl;
+                    std::cout << " -C       : keep the pulses of every interval in a file next to the sensor's" << std::endl;
+                    std::cout << "            file, with .counts appended, for fast range totals (default off)" << std::endl;
                     std::cout << " -c N     : select gpio to use (default 0)" << std::endl;
+                    std::cout << " -D       : keep the rainfall history in a round robin file of fixed size" << std::endl;
+                    std::cout << "            next to the sensor's file, with .rrd appended (default off)" << std::endl;
+                    std::cout << " -d file  : print the entries of an event log and exit" << std::endl;
+                    std::cout << " -e N     : event driven, publish every new pulse at once, looking at the" << std::endl;
+                    std::cout << "            gpio counters every N milliseconds (1..1000, default off)" << std::endl;
+                    std::cout << " -E file  : record the raw edges of the contacts that are debounced here," << std::endl;
+                    std::cout << "            before debouncing, into a binary file (default none)" << std::endl;
+                    std::cout << " -F file  : print the rows of a history file and exit" << std::endl;
                     std::cout << " -f file  : file to write hourly rainfall into (default none)" << std::endl;
-                    std::cout << " -i N     : interval in minutes between updates (1..60, default 5)" << std::endl;
+                    std::cout << " -g chip  : read the gpio (-c) as a line of a gpio character device, e.g." << std::endl;
+                    std::cout << "            /dev/gpiochip0, with kernel timestamps and debouncing like -B" << std::endl;
+                    std::cout << "            (a fifo of gpio_v2_line_event records is read as is, other" << std::endl;
+                    std::cout << "            files are refused, default CppGPIO)" << std::endl;
+                    std::cout << " -H       : print a histogram of the wakeup lateness to stderr every hour" << std::endl;
+                    std::cout << " -i N     : interval between updates, in minutes or with a unit ms, s or m" << std::endl;
+                    std::cout << "            (multiples of 100ms, 100ms..60m, default 5), aligned to the clock" << std::endl;
+                    std::cout << " -I N     : also estimate the rain rate from the time between tips and" << std::endl;
+                    std::cout << "            publish it every N (ms, s or m) into the sensor's file with .now" << std::endl;
+                    std::cout << "            appended, decaying while no tip comes (default off)" << std::endl;
+                    std::cout << " -j N     : threads for -R (default one per hardware thread)" << std::endl;
+                    std::cout << " -K N     : sync the checkpoint to disk every N intervals, 0 = never (default 1)" << std::endl;
+                    std::cout << " -k file  : keep the state of all sensors in a checkpoint file, and continue" << std::endl;
+                    std::cout << "            from it after a restart (default none)" << std::endl;
+                    std::cout << " -l file  : append every pulse to a binary event log (default none)" << std::endl;
+                    std::cout << " -M name  : publish all sensors in POSIX shared memory, e.g. /rainsensor" << std::endl;
+                    std::cout << " -m file  : read the sensors from file, one per line, e.g." << std::endl;
+                    std::cout << "            gpio=17,milliliter=5,sqcm=127.455166,file=/tmp/rain17" << std::endl;
+                    std::cout << "            curve=file and chip=file (missing keys default to -b, -c, -s, -t and -g," << std::endl;
+                    std::cout << "            default none)" << std::endl;
+                    std::cout << " -n N     : number of simulated sensors without -m (default 1)" << std::endl;
+                    std::cout << " -P spec  : correct the pulses of an interval in a counts file and exit," << std::endl;
+                    std::cout << "            spec is counts=file,at=T,pulses=N (T in seconds since the epoch)" << std::endl;
                     std::cout << " -p       : print updates to stdout too (default off)" << std::endl;
-                    std::cout << " -s N     : collector extension in square centimeters (default 127)" << std::endl;
+                    std::cout << " -Q spec  : print the pulses of the event log -l within a time range and" << std::endl;
+                    std::cout << "            exit, spec is sensor=N,from=T,to=T (seconds since the epoch) and" << std::endl;
+                    std::cout << "            optionally window=D to find the wettest aligned window, e.g. 1h," << std::endl;
+                    std::cout << "            and counts=file to read a counts file instead of the log" << std::endl;
+                    std::cout << " -s N     : collector extension in square centimeters (default 127, e.g. 127.455166)" << std::endl;
+                    std::cout << " -R list  : replay the comma separated event logs through the interval" << std::endl;
+                    std::cout << "            aggregation with the options given (-i, -r, -W, -b, -s, -m)," << std::endl;
+                    std::cout << "            print a summary per sensor (and every update with -p) and exit" << std::endl;
+                    std::cout << " -r N     : width of the buckets of the hourly window, a divisor of an hour" << std::endl;
+                    std::cout << "            and multiple of 100ms, with unit ms, s or m (default: the largest" << std::endl;
+                    std::cout << "            width that divides both the interval and an hour)" << std::endl;
+                    std::cout << " -T cpu   : read the gpio counters in a thread of their own, pinned to the" << std::endl;
+                    std::cout << "            given cpu or any, that timestamps the pulses while the main loop" << std::endl;
+                    std::cout << "            writes files (default off)" << std::endl;
+                    std::cout << " -t file  : correct the volume of a tip by the time since the one before," << std::endl;
+                    std::cout << "            from a file with lines of seconds and milliliters (default none)" << std::endl;
+                    std::cout << " -S spec  : simulate the rain gauge instead of reading the gpio, spec is a" << std::endl;
+                    std::cout << "            comma separated list of rate=N (pulses/s), burst-rate=N," << std::endl;
+                    std::cout << "            burst-every=N (s), burst-length=N (s), jitter=0..1, seed=N," << std::endl;
+                    std::cout << "            bounces=N per pulse and bounce-time=N (ms) for a bouncing contact" << std::endl;
+                    std::cout << " -U path  : answer every connection to a unix socket at path with the" << std::endl;
+                    std::cout << "            rainfall of the last hour, the total and the tips of all sensors," << std::endl;
+                    std::cout << "            one line each (default none)" << std::endl;
+                    std::cout << " -W list  : also report the rainfall of rolling windows, e.g. 10m,24h,7d:1h" << std::endl;
+                    std::cout << "            (length[:resolution] in ms, s, m, h or d, multiples of -r), into" << std::endl;
+                    std::cout << "            the sensor's file with .length appended (default none)" << std::endl;
+                    std::cout << " -w mode  : how to write the file: truncate (rewrite in place), rename (write" << std::endl;
+                    std::cout << "            a temporary file and rename it, default) or mmap (fixed 64 byte" << std::endl;
+                    std::cout << "            record \"sequence value sequence\" updated in memory)" << std::endl;
+                    std::cout << " -X file  : sweep debounce times over a recording of -E with -j threads," << std::endl;
+                    std::cout << "            print the edges accepted by each and the limits to use, and exit" << std::endl;
                     std::cout << std::endl;
                     exit(0);
                 case 'i':
-                    options.interval = atoi(optarg);
-                    if (options.interval < 1 || options.interval > 60) {
-                        std::cerr << "invalid value for interval (1..60): " << options.interval << std::endl;
+                {
+                    unsigned long interval = 0;
+                    if (!parse_duration(optarg, interval) || interval % 100 || interval > 3600000) {
+                        std::cerr << "invalid value for interval (100ms..60m): " << optarg << std::endl;
+                        exit(1);
+                    }
+                    options.interval = std::chrono::milliseconds(interval);
+                    break;
+                }
+                case 'I':
+                {
+                    unsigned long period = 0;
+                    if (!parse_duration(optarg, period) || !period || period % 100 || period > 3600000) {
+                        std::cerr << "invalid value for intensity period (100ms..60m): " << optarg << std::endl;
+                        exit(1);
+                    }
+                    options.intensity_period = std::chrono::milliseconds(period);
+                    break;
+                }
+                case 'j':
+                    options.threads = atoi(optarg);
+                    if (options.threads < 1 || options.threads > 1024) {
+                        std::cerr << "invalid value for threads (1..1024): " << options.threads << std::endl;
+                        exit(1);
+                    }
+                    break;
+                case 'K':
+                    options.checkpoint_sync = atoi(optarg);
+                    if (options.checkpoint_sync < 0 || options.checkpoint_sync > 100000) {
+                        std::cerr << "invalid value for checkpoint sync (0..100000): " << options.checkpoint_sync << std::endl;
+                        exit(1);
+                    }
+                    break;
+                case 'k':
+                    options.checkpoint = optarg;
+                    break;
+                case 'l':
+                    options.event_log = optarg;
+                    break;
+                case 'M':
+                    options.shared_memory = optarg;
+                    break;
+                case 'm':
+                    options.sensor_list = optarg;
+                    break;
+                case 'n':
+                    options.simulated_sensors = atoi(optarg);
+                    if (options.simulated_sensors < 1 || options.simulated_sensors > 1000000) {
+                        std::cerr << "invalid value for simulated sensors (1..1000000): " << options.simulated_sensors << std::endl;
                         exit(1);
                     }
                     break;
                 case 'p':
                     options.print_to_console = true;
                     break;
+                case 'P':
+                    options.patch = optarg;
+                    break;
+                case 'Q':
+                    options.query = optarg;
+                    break;
                 case 's':
-                    options.sqcm = atoi(optarg);
-                    if (options.sqcm < 1 || options.sqcm > 10000) {
-                        std::cerr << "invalid value for square centimeters (1..10000): " << options.sqcm << std::endl;
+                    if (!parse_sqcm(optarg, options.micro_sqcm)) {
+                        std::cerr << "invalid value for square centimeters (1..10000, up to 6 decimals): " << optarg << std::endl;
+                        exit(1);
+                    }
+                    break;
+                case 't':
+                    options.curve_file = optarg;
+                    break;
+                case 'X':
+                    options.edge_analysis = optarg;
+                    break;
+                case 'U':
+                    options.control_socket = optarg;
+                    break;
+                case 'T':
+                    options.capture = true;
+                    if (strcmp(optarg, "any") != 0) {
+                        options.capture_cpu = atoi(optarg);
+                        if (options.capture_cpu < 0 || options.capture_cpu > 1023 || !isdigit(static_cast<unsigned char>(optarg[0]))) {
+                            std::cerr << "invalid value for capture cpu (0..1023 or any): " << optarg << std::endl;
+                            exit(1);
+                        }
+                    }
+                    break;
+                case 'R':
+                {
+                    std::string list = optarg;
+                    for (std::string::size_type pos = 0; pos < list.size();) {
+                        std::string::size_type end = list.find(',', pos);
+                        if (end == std::string::npos) end = list.size();
+                        if (end > pos) options.replay.push_back(list.substr(pos, end - pos));
+                        pos = end + 1;
+                    }
+                    break;
+                }
+                case 'r':
+                {
+                    unsigned long width = 0;
+                    if (!parse_duration(optarg, width) || width % 100 || 3600000 % width) {
+                        std::cerr << "invalid value for bucket width (100ms..60m, divisor of an hour): " << optarg << std::endl;
+                        exit(1);
+                    }
+                    options.bucket_width = std::chrono::milliseconds(width);
+                    break;
+                }
+                case 'S':
+                    options.simulate = true;
+                    if (!parse_simulation(optarg, options.simulation)) {
+                        std::cerr << "invalid simulation parameters: " << optarg << std::endl;
+                        exit(1);
+                    }
+                    break;
+                case 'W':
+                    if (!parse_windows(optarg, options.windows)) {
+                        std::cerr << "invalid windows: " << optarg << std::endl;
+                        exit(1);
+                    }
+                    break;
+                case 'w':
+                    if (!strcmp(optarg, "truncate")) options.publish_method = Publisher::TRUNCATE;
+                    else if (!strcmp(optarg, "rename")) options.publish_method = Publisher::RENAME;
+                    else if (!strcmp(optarg, "mmap")) options.publish_method = Publisher::MMAP;
+                    else {
+                        std::cerr << "invalid write mode (truncate, rename, mmap): " << optarg << std::endl;
                         exit(1);
                     }
                     break;
@@ -181,8 +1697,63 @@ int main(int argc, char *argv[])
         }
     }
 
-    // run the endless loop to capture the rain counter
+    // buckets that fit both into the hour and into the interval
+    if (!options.bucket_width.count()) {
+        options.bucket_width = std::chrono::milliseconds(gcd(static_cast<unsigned long>(options.interval.count()), 3600000));
+    }
+
+    if (options.archives.empty()) parse_archives("1m:2d,10m:60d,1h:3650d", options.archives);
+
+    // collect the sensors to run
+    if (!options.sensor_list.empty()) {
+        read_sensor_list(options);
+        if (options.sensors.empty()) {
+            std::cerr << "no sensors in " << options.sensor_list << std::endl;
+            exit(1);
+        }
+    } else {
+        sensor_option_t sensor;
+        sensor.filename = options.filename;
+        sensor.gpio_pin = options.gpio_pin;
+        sensor.gpio_chip = options.gpio_chip;
+        sensor.milliliter = options.milliliter;
+        sensor.micro_sqcm = options.micro_sqcm;
+        sensor.curve_file = options.curve_file;
+        options.sensors.push_back(sensor);
+
+        if (options.simulate) {
+            // replicate the sensor, but only the first one writes the file
+            sensor.filename.clear();
+            options.sensors.resize(options.simulated_sensors, sensor);
+        }
+    }
+
+    load_curves(options);
+
+    if (!options.edge_analysis.empty()) {
+        analyze_edges(options);
+        exit(0);
+    }
+
+    if (!options.query.empty()) {
+        query_event_log(options);
+        exit(0);
+    }
+
+    if (!options.patch.empty()) {
+        patch_counts(options);
+        exit(0);
+    }
+
+    if (!options.replay.empty()) {
+        replay_event_logs(options);
+        exit(0);
+    }
+
+    // run the loop to capture the rain counters until we are stopped
     count_rain(options);
     
     return 0;
 }
+
+#endif
@@ -0,0 +1,265 @@
+/*
+
+ rainshm.hpp
+
+ live readout of all sensors in a POSIX shared memory segment, and the
+ reader library for local consumers. Readers map the segment read-only
+ and copy the values they need, without any parsing, lock or system call.
+
+ The segment starts with a header, followed by one record per sensor:
+
+   header (64 bytes):  magic "RSHM", version, number of sensors, length
+                       of the bucket ring, size of a sensor record, width
+                       of a bucket in milliseconds
+   record:             sensor_record_t, followed by the bucket ring
+
+ Every record is protected by a sequence lock: the writer makes the
+ sequence odd, updates the record and makes it even again. A reader that
+ sees the same even sequence before and after copying has a consistent
+ snapshot.
+
+ link with -lrt on older C libraries
+
+ */
+
+#ifndef RAINSENSOR_RAINSHM_HPP
+#define RAINSENSOR_RAINSHM_HPP
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <atomic>
+
+
+namespace rainshm {
+
+const uint32_t magic = 0x4d485352; // "RSHM" in little endian
+const uint32_t version = 2;
+
+
+struct header_t {
+    std::atomic<uint32_t> magic;    // set last, when the segment is ready
+    uint32_t version;
+    uint32_t sensor_count;
+    uint32_t ring_length;
+    uint32_t record_size;
+    uint32_t bucket_milliseconds;
+    uint8_t reserved[40];
+};
+
+static_assert(sizeof(header_t) == 64, "the header must fill exactly one cache line");
+
+
+// the values of one sensor
+
+struct snapshot_t {
+    double mm_per_hour;
+    double total_mm;
+    uint64_t total_events;
+    int64_t last_tip;           // microseconds since the epoch, 0 = none yet
+    uint32_t ring_position;     // the bucket currently filled
+};
+
+
+struct sensor_record_t {
+    std::atomic<uint32_t> sequence;
+    uint32_t reserved;
+    snapshot_t values;
+    // followed by uint64_t buckets[ring_length]
+};
+
+
+inline std::size_t record_size(uint32_t ring_length)
+{
+    // keep every record on its own cache lines
+    std::size_t size = sizeof(sensor_record_t) + ring_length * sizeof(uint64_t);
+    return (size + 63) & ~static_cast<std::size_t>(63);
+}
+
+
+// common part of writer and reader: the mapping of the segment
+
+class Segment {
+public:
+    ~Segment() { unmap(); }
+
+    uint32_t sensor_count() const { return m_header ? m_header->sensor_count : 0; }
+    uint32_t ring_length() const { return m_header ? m_header->ring_length : 0; }
+    uint32_t bucket_milliseconds() const { return m_header ? m_header->bucket_milliseconds : 0; }
+
+protected:
+    Segment() {}
+
+    sensor_record_t* record(std::size_t sensor) const
+    {
+        return reinterpret_cast<sensor_record_t*>(m_base + sizeof(header_t) + sensor * m_header->record_size);
+    }
+
+    uint64_t* buckets(std::size_t sensor) const
+    {
+        return reinterpret_cast<uint64_t*>(record(sensor) + 1);
+    }
+
+    void unmap()
+    {
+        if (m_base) munmap(m_base, m_size);
+        m_base = nullptr;
+        m_header = nullptr;
+    }
+
+    uint8_t* m_base = nullptr;
+    std::size_t m_size = 0;
+    header_t* m_header = nullptr;
+
+private:
+    Segment(const Segment&);
+    Segment& operator=(const Segment&);
+};
+
+
+// the writer, used by rainsensor
+
+class Writer : public Segment {
+public:
+    // create (or resize) the segment, name is like "/rainsensor"
+    bool create(const std::string& name, uint32_t sensor_count, uint32_t ring_length, uint32_t bucket_milliseconds)
+    {
+        unmap();
+
+        int fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) return false;
+
+        std::size_t size = sizeof(header_t) + sensor_count * record_size(ring_length);
+        // shrink to zero first, so that readers of an old layout see a fresh segment
+        if (ftruncate(fd, 0) != 0 || ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            close(fd);
+            return false;
+        }
+
+        void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) return false;
+
+        m_base = static_cast<uint8_t*>(map);
+        m_size = size;
+        m_header = reinterpret_cast<header_t*>(m_base);
+        m_header->version = version;
+        m_header->sensor_count = sensor_count;
+        m_header->ring_length = ring_length;
+        m_header->record_size = static_cast<uint32_t>(record_size(ring_length));
+        m_header->bucket_milliseconds = bucket_milliseconds;
+        m_header->magic.store(magic, std::memory_order_release);
+        // nothing published yet, the first update copies the whole ring
+        m_started.assign(sensor_count, static_cast<uint64_t>(never));
+        return true;
+    }
+
+    bool is_open() const { return m_base != nullptr; }
+
+    // update the record of a sensor. The buckets are read with the given
+    // stride, so they can come straight out of an interval-major ring.
+    // started counts the buckets started so far: only those started since
+    // the last update of the sensor and the one it was in are copied,
+    // the others did not change
+    void update(std::size_t sensor, const snapshot_t& values, const unsigned long* ring, std::size_t stride, uint64_t started)
+    {
+        sensor_record_t* rec = record(sensor);
+        uint64_t* out = buckets(sensor);
+        const uint32_t length = m_header->ring_length;
+
+        uint64_t changed = m_started[sensor] == never || started - m_started[sensor] >= length ? length : started - m_started[sensor] + 1;
+        m_started[sensor] = started;
+        uint32_t b = (values.ring_position + length - static_cast<uint32_t>(changed - 1)) % length;
+
+        uint32_t sequence = rec->sequence.load(std::memory_order_relaxed);
+        rec->sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        rec->values = values;
+        for (uint64_t n = 0; n < changed; ++n) {
+            out[b] = ring[b * stride];
+            if (++b == length) b = 0;
+        }
+
+        rec->sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+private:
+    static const uint64_t never = static_cast<uint64_t>(-1);
+
+    std::vector<uint64_t> m_started; // per sensor, at its last update
+};
+
+
+// the reader library
+
+class Reader : public Segment {
+public:
+    // map an existing segment, returns false if there is none or it has
+    // an unknown layout
+    bool open(const std::string& name)
+    {
+        unmap();
+
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0) return false;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(header_t)) {
+            close(fd);
+            return false;
+        }
+
+        void* map = mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) return false;
+
+        m_base = static_cast<uint8_t*>(map);
+        m_size = static_cast<std::size_t>(st.st_size);
+        m_header = reinterpret_cast<header_t*>(m_base);
+
+        if (m_header->magic.load(std::memory_order_acquire) != magic
+            || m_header->version != version
+            || m_header->record_size != record_size(m_header->ring_length)
+            || sizeof(header_t) + static_cast<std::size_t>(m_header->sensor_count) * m_header->record_size > m_size) {
+            unmap();
+            return false;
+        }
+        return true;
+    }
+
+    // copy a consistent snapshot of a sensor, and its bucket ring if
+    // buckets_out is not null (ring_length() values). Returns false if the
+    // writer kept the record busy for too long
+    bool read(std::size_t sensor, snapshot_t& values, uint64_t* buckets_out = nullptr) const
+    {
+        if (sensor >= sensor_count()) return false;
+
+        const sensor_record_t* rec = record(sensor);
+        const uint64_t* in = buckets(sensor);
+        const uint32_t length = m_header->ring_length;
+
+        for (int attempt = 0; attempt < 1000; ++attempt) {
+            uint32_t before = rec->sequence.load(std::memory_order_acquire);
+            if (before & 1) continue;
+
+            values = rec->values;
+            if (buckets_out) memcpy(buckets_out, in, length * sizeof(uint64_t));
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (rec->sequence.load(std::memory_order_relaxed) == before) return true;
+        }
+        return false;
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,380 @@
+/*
+
+ reactor.hpp
+
+ one thread that waits for everything the main loop reacts to at once:
+ descriptors that turn readable, deadlines and signals. On Linux all of
+ them are descriptors in a single epoll set. The deadlines are timerfds
+ armed with absolute times on the monotonic clock, the clock of
+ std::chrono::steady_clock, and the signals arrive through a signalfd. A
+ loop with thousands of sensors sleeps in one epoll_wait() until one of
+ them has an edge or a deadline is due, and costs no CPU in between.
+ Elsewhere the same interface runs on poll(), with the nearest deadline
+ as its timeout and the signals written into a pipe.
+
+ The handlers run one after the other in the thread that called run().
+
+ */
+
+#ifndef RAINSENSOR_REACTOR_HPP
+#define RAINSENSOR_REACTOR_HPP
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#else
+#include <poll.h>
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <functional>
+
+
+class Reactor {
+public:
+    typedef std::function<void()> handler_t;
+    typedef std::chrono::steady_clock::time_point time_point_t;
+
+    Reactor() {}
+    ~Reactor() { close(); }
+
+    bool open(std::string& error)
+    {
+        close();
+#ifdef __linux__
+        m_epoll = epoll_create1(EPOLL_CLOEXEC);
+        if (m_epoll < 0) {
+            error = std::string("Cannot create epoll set: ") + strerror(errno);
+            return false;
+        }
+#else
+        (void)error;
+#endif
+        return true;
+    }
+
+    void close()
+    {
+        for (std::size_t i = 0; i < m_watches.size(); ++i) {
+            if (m_watches[i].kind != watch_t::descriptor && m_watches[i].fd >= 0) ::close(m_watches[i].fd);
+        }
+        m_watches.clear();
+#ifdef __linux__
+        m_signals.clear();
+        if (m_epoll >= 0) ::close(m_epoll);
+        m_epoll = -1;
+#else
+        if (m_signal_pipe >= 0) {
+            for (std::size_t i = 0; i < m_signals.size(); ++i) ::signal(m_signals[i].signal, SIG_DFL);
+            ::close(m_signal_pipe);
+            ::close(signal_pipe());
+            signal_pipe() = -1;
+        }
+        m_signal_pipe = -1;
+        m_signals.clear();
+        m_pollfds.clear();
+#endif
+    }
+
+    // call the handler whenever the descriptor is readable. The handler has
+    // to read what is there, or it is called again right away. The
+    // descriptor stays with the caller
+    bool watch(int fd, handler_t handler, std::string& error)
+    {
+        return add_watch(watch_t::descriptor, fd, handler, error) != none;
+    }
+
+    // a timer, disarmed until it gets a deadline. Returns its id, or none
+    std::size_t add_timer(handler_t handler, std::string& error)
+    {
+#ifdef __linux__
+        int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (fd < 0) {
+            error = std::string("Cannot create timer: ") + strerror(errno);
+            return none;
+        }
+#else
+        int fd = -1;
+#endif
+        return add_watch(watch_t::timer, fd, handler, error);
+    }
+
+    // call the timer's handler once at the deadline. A new deadline
+    // replaces the old one, one that passed already is due at once
+    void arm(std::size_t timer, time_point_t deadline)
+    {
+        watch_t& watch = m_watches[timer];
+        watch.armed = true;
+        watch.deadline = deadline;
+#ifdef __linux__
+        std::chrono::nanoseconds since = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch());
+        struct itimerspec spec;
+        memset(&spec, 0, sizeof(spec));
+        // zero would disarm the timer
+        if (since.count() <= 0) since = std::chrono::nanoseconds(1);
+        spec.it_value.tv_sec = static_cast<time_t>(since.count() / 1000000000);
+        spec.it_value.tv_nsec = static_cast<long>(since.count() % 1000000000);
+        timerfd_settime(watch.fd, TFD_TIMER_ABSTIME, &spec, nullptr);
+#endif
+    }
+
+    void disarm(std::size_t timer)
+    {
+        watch_t& watch = m_watches[timer];
+        watch.armed = false;
+#ifdef __linux__
+        struct itimerspec spec;
+        memset(&spec, 0, sizeof(spec));
+        timerfd_settime(watch.fd, 0, &spec, nullptr);
+#endif
+    }
+
+    // deliver the signal to the handler instead of its default action.
+    // Threads started later inherit that it is blocked, so that it reaches
+    // the reactor and not one of them
+    bool catch_signal(int signal, handler_t handler, std::string& error)
+    {
+        signal_t caught;
+        caught.signal = signal;
+        caught.handler = handler;
+        m_signals.push_back(caught);
+#ifdef __linux__
+        sigset_t set;
+        sigemptyset(&set);
+        for (std::size_t i = 0; i < m_signals.size(); ++i) sigaddset(&set, m_signals[i].signal);
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+        std::size_t watch = find_watch(watch_t::signals);
+        int fd = signalfd(watch == none ? -1 : m_watches[watch].fd, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (fd < 0) {
+            error = std::string("Cannot catch signals: ") + strerror(errno);
+            return false;
+        }
+        if (watch == none && add_watch(watch_t::signals, fd, handler_t(), error) == none) return false;
+#else
+        if (m_signal_pipe < 0) {
+            int fds[2];
+            if (pipe(fds) != 0) {
+                error = std::string("Cannot catch signals: ") + strerror(errno);
+                return false;
+            }
+            fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+            fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+            m_signal_pipe = fds[0];
+            signal_pipe() = fds[1];
+            if (add_watch(watch_t::descriptor, m_signal_pipe, [this]() { read_signal_pipe(); }, error) == none) return false;
+        }
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = &Reactor::on_signal;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_RESTART;
+        if (sigaction(signal, &action, nullptr) != 0) {
+            error = std::string("Cannot catch signals: ") + strerror(errno);
+            return false;
+        }
+#endif
+        return true;
+    }
+
+    // dispatch until a handler calls stop()
+    void run()
+    {
+        m_running = true;
+        while (m_running) {
+#ifdef __linux__
+            struct epoll_event events[batch];
+            int count = epoll_wait(m_epoll, events, batch, -1);
+            if (count < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            ++m_wakeups;
+            for (int e = 0; e < count && m_running; ++e) dispatch(static_cast<std::size_t>(events[e].data.u64));
+#else
+            int count = ::poll(m_pollfds.empty() ? nullptr : &m_pollfds[0], static_cast<nfds_t>(m_pollfds.size()), timeout());
+            if (count < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            ++m_wakeups;
+            time_point_t now = std::chrono::steady_clock::now();
+            for (std::size_t i = 0; i < m_watches.size() && m_running; ++i) {
+                watch_t& watch = m_watches[i];
+                if (watch.kind == watch_t::timer ? watch.armed && watch.deadline <= now
+                                                 : (m_pollfds[watch.poll].revents & (POLLIN | POLLHUP | POLLERR)) != 0) {
+                    dispatch(i);
+                }
+            }
+#endif
+        }
+    }
+
+    void stop() { m_running = false; }
+
+    // how often run() woke up, for the statistics
+    uint64_t wakeups() const { return m_wakeups; }
+
+    static const std::size_t none = static_cast<std::size_t>(-1);
+
+private:
+    Reactor(const Reactor&);
+    Reactor& operator=(const Reactor&);
+
+    static const int batch = 64;
+
+    struct watch_t {
+        enum kind_t { descriptor, timer, signals };
+        kind_t kind = descriptor;
+        int fd = -1;
+        handler_t handler;
+        bool armed = false;
+        time_point_t deadline;
+        std::size_t poll = 0; // the entry in the pollfd array, without epoll
+    };
+
+    struct signal_t {
+        int signal = 0;
+        handler_t handler;
+    };
+
+    std::size_t add_watch(watch_t::kind_t kind, int fd, handler_t handler, std::string& error)
+    {
+        watch_t watch;
+        watch.kind = kind;
+        watch.fd = fd;
+        watch.handler = handler;
+        std::size_t index = m_watches.size();
+#ifdef __linux__
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.u64 = index;
+        if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &event) != 0) {
+            error = "Cannot watch descriptor " + std::to_string(fd) + ": " + strerror(errno);
+            if (kind != watch_t::descriptor) ::close(fd);
+            return none;
+        }
+#else
+        if (kind == watch_t::descriptor) {
+            struct pollfd entry;
+            entry.fd = fd;
+            entry.events = POLLIN;
+            entry.revents = 0;
+            watch.poll = m_pollfds.size();
+            m_pollfds.push_back(entry);
+        }
+        (void)error;
+#endif
+        m_watches.push_back(watch);
+        return index;
+    }
+
+    std::size_t find_watch(watch_t::kind_t kind) const
+    {
+        for (std::size_t i = 0; i < m_watches.size(); ++i) {
+            if (m_watches[i].kind == kind) return i;
+        }
+        return none;
+    }
+
+    void dispatch(std::size_t index)
+    {
+        watch_t& watch = m_watches[index];
+        switch (watch.kind) {
+            case watch_t::descriptor:
+                watch.handler();
+                break;
+            case watch_t::timer: {
+#ifdef __linux__
+                // a timer that was armed anew after it expired reads nothing
+                uint64_t expirations;
+                if (::read(watch.fd, &expirations, sizeof(expirations)) != sizeof(expirations)) break;
+#endif
+                watch.armed = false;
+                watch.handler();
+                break;
+            }
+            case watch_t::signals: {
+#ifdef __linux__
+                struct signalfd_siginfo info;
+                while (::read(watch.fd, &info, sizeof(info)) == sizeof(info)) deliver(static_cast<int>(info.ssi_signo));
+#endif
+                break;
+            }
+        }
+    }
+
+    void deliver(int signal)
+    {
+        for (std::size_t i = 0; i < m_signals.size(); ++i) {
+            if (m_signals[i].signal == signal) m_signals[i].handler();
+        }
+    }
+
+#ifndef __linux__
+    // the write end of the pipe, for the signal handler
+    static int& signal_pipe()
+    {
+        static int fd = -1;
+        return fd;
+    }
+
+    static void on_signal(int signal)
+    {
+        int saved = errno;
+        unsigned char number = static_cast<unsigned char>(signal);
+        ssize_t rc = ::write(signal_pipe(), &number, 1);
+        (void)rc;
+        errno = saved;
+    }
+
+    void read_signal_pipe()
+    {
+        unsigned char numbers[16];
+        ssize_t rc;
+        while ((rc = ::read(m_signal_pipe, numbers, sizeof(numbers))) > 0) {
+            for (ssize_t i = 0; i < rc; ++i) deliver(numbers[i]);
+        }
+    }
+
+    // until the nearest deadline, rounded up to whole milliseconds
+    int timeout() const
+    {
+        bool armed = false;
+        time_point_t nearest;
+        for (std::size_t i = 0; i < m_watches.size(); ++i) {
+            const watch_t& watch = m_watches[i];
+            if (watch.kind != watch_t::timer || !watch.armed) continue;
+            if (!armed || watch.deadline < nearest) nearest = watch.deadline;
+            armed = true;
+        }
+        if (!armed) return -1;
+        std::chrono::steady_clock::duration left = nearest - std::chrono::steady_clock::now();
+        if (left <= std::chrono::steady_clock::duration::zero()) return 0;
+        return static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(left + std::chrono::milliseconds(1) - std::chrono::nanoseconds(1)).count());
+    }
+
+    int m_signal_pipe = -1; // the read end
+    std::vector<struct pollfd> m_pollfds;
+#else
+    int m_epoll = -1;
+#endif
+    std::vector<watch_t> m_watches;
+    std::vector<signal_t> m_signals;
+    bool m_running = false;
+    uint64_t m_wakeups = 0;
+};
+
+#endif
@@ -0,0 +1,321 @@
+/*
+
+ rrd.hpp
+
+ the rainfall history of a sensor in a round robin file: a fixed number
+ of archives, each a ring of rows with a fixed step (say 1 minute for 2
+ days, 10 minutes for 2 months and 1 hour for 10 years). The file never
+ grows, every update writes the current row of each archive in place,
+ and a long range read takes the rows of a coarse archive as they are.
+
+ The file is memory mapped and laid out as
+
+   header (64 bytes):   magic "RSRR", version, number of archives,
+                        heartbeat, time of the last update, rainfall
+                        per pulse
+   archive (32 bytes):  step, number of rows, index of the current row
+                        (time / step), one per archive
+   rows:                double, rainfall in mm, NaN = unknown, the rows
+                        of all archives one after the other
+
+ All times are milliseconds since the epoch, row i of an archive covers
+ [i * step, (i + 1) * step) and is kept at i % rows. An update spreads
+ the rainfall since the last update evenly over the time in between, a
+ gap longer than the heartbeat (the program was not running) is unknown.
+
+ */
+
+#ifndef RAINSENSOR_RRD_HPP
+#define RAINSENSOR_RRD_HPP
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <limits>
+#include <cmath>
+#include <algorithm>
+
+
+namespace rrd {
+
+const uint32_t magic = 0x52525352; // "RSRR" in little endian
+const uint32_t version = 1;
+
+
+struct header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t archive_count;
+    uint32_t reserved0;
+    int64_t heartbeat;
+    int64_t last_update;
+    double mm_per_pulse;
+    uint8_t reserved[24];
+};
+
+static_assert(sizeof(header_t) == 64, "the header must fill exactly one cache line");
+
+
+struct archive_header_t {
+    int64_t step;
+    uint64_t rows;
+    int64_t current;        // the row last written to, as time / step
+    uint64_t reserved;
+};
+
+static_assert(sizeof(archive_header_t) == 32, "archive headers are 32 bytes");
+
+
+// the configuration of one archive, in milliseconds
+
+struct archive_spec_t {
+    int64_t step = 0;
+    uint64_t rows = 0;
+};
+
+
+// the rows returned by a read: values[i] covers [start + i * step, start + (i + 1) * step)
+
+struct fetch_t {
+    int64_t start = 0;
+    int64_t step = 0;
+    std::vector<double> values;
+};
+
+
+inline double unknown() { return std::numeric_limits<double>::quiet_NaN(); }
+
+
+class File {
+public:
+    File() {}
+    ~File() { close(); }
+
+    // map a history file, creating it with the given archives if it does
+    // not exist. Returns false if an existing file has other archives
+    bool open(const std::string& filename, const std::vector<archive_spec_t>& archives, int64_t heartbeat, double mm_per_pulse)
+    {
+        close();
+
+        int fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) return false;
+
+        std::size_t size = sizeof(header_t) + archives.size() * sizeof(archive_header_t);
+        for (std::size_t a = 0; a < archives.size(); ++a) size += archives[a].rows * sizeof(double);
+
+        struct stat st;
+        bool fresh = fstat(fd, &st) == 0 && st.st_size == 0;
+        if (fresh && ftruncate(fd, static_cast<off_t>(size)) != 0) fresh = false;
+        if (!fresh && (fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) != size)) {
+            ::close(fd);
+            return false;
+        }
+
+        void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (map == MAP_FAILED) return false;
+
+        m_base = static_cast<uint8_t*>(map);
+        m_size = size;
+
+        if (fresh) {
+            header_t* h = header();
+            h->version = version;
+            h->archive_count = static_cast<uint32_t>(archives.size());
+            h->last_update = 0;
+            for (std::size_t a = 0; a < archives.size(); ++a) {
+                archive_header_t* ah = archive(a);
+                ah->step = archives[a].step;
+                ah->rows = archives[a].rows;
+                ah->current = 0;
+                std::fill(rows(a), rows(a) + ah->rows, unknown());
+            }
+            h->magic = magic;
+        }
+
+        // an existing file must have been created the same way
+        bool same = header()->magic == magic && header()->version == version && header()->archive_count == archives.size();
+        for (std::size_t a = 0; same && a < archives.size(); ++a) {
+            same = archive(a)->step == archives[a].step && archive(a)->rows == archives[a].rows;
+        }
+        if (!same) {
+            close();
+            return false;
+        }
+
+        // a changed calibration applies from now on
+        header()->heartbeat = heartbeat;
+        header()->mm_per_pulse = mm_per_pulse;
+        return true;
+    }
+
+    // map an existing history file for reading, with the archives it has
+    bool open(const std::string& filename)
+    {
+        close();
+
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(header_t)) {
+            ::close(fd);
+            return false;
+        }
+
+        void* map = mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (map == MAP_FAILED) return false;
+
+        m_base = static_cast<uint8_t*>(map);
+        m_size = static_cast<std::size_t>(st.st_size);
+
+        // check the layout before touching the archives
+        const header_t* h = header();
+        bool valid = h->magic == magic && h->version == version
+            && sizeof(header_t) + h->archive_count * sizeof(archive_header_t) <= m_size;
+        std::size_t size = sizeof(header_t) + h->archive_count * sizeof(archive_header_t);
+        for (std::size_t a = 0; valid && a < h->archive_count; ++a) {
+            valid = archive(a)->step > 0 && archive(a)->rows > 0 && archive(a)->rows <= m_size;
+            size += archive(a)->rows * sizeof(double);
+        }
+        if (!valid || size != m_size) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    bool is_open() const { return m_base != nullptr; }
+
+    void close()
+    {
+        if (m_base) munmap(m_base, m_size);
+        m_base = nullptr;
+    }
+
+    // add the pulses counted up to time. Returns false if time is not after
+    // the last update
+    bool update(int64_t time, uint64_t pulses)
+    {
+        header_t* h = header();
+        int64_t last = h->last_update;
+        if (time <= last) return false;
+
+        double mm = pulses * h->mm_per_pulse;
+        bool known = last && time - last <= h->heartbeat;
+        // without a known start, all pulses go into the row of time
+        int64_t from = known ? last : time - 1;
+
+        for (std::size_t a = 0; a < h->archive_count; ++a) {
+            archive_header_t* ah = archive(a);
+            double* ring = rows(a);
+            int64_t first = from / ah->step;
+            int64_t current = (time - 1) / ah->step;
+
+            // start the rows we enter: empty while we were running, unknown otherwise
+            int64_t begin = std::max(ah->current + 1, current - static_cast<int64_t>(ah->rows) + 1);
+            for (int64_t row = begin; row <= current; ++row) {
+                ring[row % ah->rows] = known || row == current ? 0 : unknown();
+            }
+            if (ah->current < current) ah->current = current;
+
+            // spread the rain over the time since the last update
+            int64_t start = std::max(first, current - static_cast<int64_t>(ah->rows) + 1);
+            for (int64_t row = start; row <= current; ++row) {
+                int64_t overlap = std::min(time, (row + 1) * ah->step) - std::max(from, row * ah->step);
+                double& value = ring[row % ah->rows];
+                if (std::isnan(value)) value = 0;
+                value += mm * overlap / (time - from);
+            }
+        }
+
+        h->last_update = time;
+        return true;
+    }
+
+    // read the rows covering [from, to) from the finest archive that still
+    // holds from and whose step is at least resolution
+    bool fetch(int64_t from, int64_t to, int64_t resolution, fetch_t& out) const
+    {
+        const header_t* h = header();
+        if (!h->archive_count || to <= from) return false;
+
+        // among the archives with a step of at least resolution take the
+        // finest one that still holds from, or else the one reaching back
+        // furthest. If all are finer, take the coarsest
+        std::size_t best = h->archive_count;
+        for (std::size_t a = 0; a < h->archive_count; ++a) {
+            if (archive(a)->step < resolution) continue;
+            if (best == h->archive_count
+                || (holds(a, from) && (!holds(best, from) || archive(a)->step < archive(best)->step))
+                || (!holds(a, from) && !holds(best, from) && span(a) > span(best))) best = a;
+        }
+        if (best == h->archive_count) {
+            best = 0;
+            for (std::size_t a = 1; a < h->archive_count; ++a) {
+                if (archive(a)->step > archive(best)->step) best = a;
+            }
+        }
+
+        const archive_header_t* ah = archive(best);
+        const double* ring = rows(best);
+        int64_t first = from / ah->step;
+        int64_t last = (to - 1) / ah->step;
+        int64_t oldest = ah->current - static_cast<int64_t>(ah->rows) + 1;
+
+        out.start = first * ah->step;
+        out.step = ah->step;
+        out.values.clear();
+        for (int64_t row = first; row <= last; ++row) {
+            out.values.push_back(row < oldest || row > ah->current ? unknown() : ring[row % ah->rows]);
+        }
+        return true;
+    }
+
+    std::size_t archives() const { return header()->archive_count; }
+    archive_spec_t archive_spec(std::size_t a) const
+    {
+        archive_spec_t spec;
+        spec.step = archive(a)->step;
+        spec.rows = archive(a)->rows;
+        return spec;
+    }
+    int64_t last_update() const { return header()->last_update; }
+    double mm_per_pulse() const { return header()->mm_per_pulse; }
+
+private:
+    File(const File&);
+    File& operator=(const File&);
+
+    header_t* header() const { return reinterpret_cast<header_t*>(m_base); }
+    archive_header_t* archive(std::size_t a) const { return reinterpret_cast<archive_header_t*>(m_base + sizeof(header_t)) + a; }
+
+    double* rows(std::size_t a) const
+    {
+        double* p = reinterpret_cast<double*>(archive(header()->archive_count));
+        for (std::size_t i = 0; i < a; ++i) p += archive(i)->rows;
+        return p;
+    }
+
+    // the time an archive reaches back, and whether it still has the row of time
+    int64_t span(std::size_t a) const { return static_cast<int64_t>(archive(a)->rows) * archive(a)->step; }
+    bool holds(std::size_t a, int64_t time) const
+    {
+        return time / archive(a)->step > archive(a)->current - static_cast<int64_t>(archive(a)->rows);
+    }
+
+    uint8_t* m_base = nullptr;
+    std::size_t m_size = 0;
+};
+
+}
+
+#endif
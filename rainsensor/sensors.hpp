@@ -0,0 +1,511 @@
+/*
+
+ sensors.hpp
+
+ the state of all rain gauges handled by one process. All gauges are
+ sampled at the same instant, so their state is kept as a structure of
+ arrays: one vector per field, indexed by sensor number, and a single
+ bucket ring that is shared by all sensors. One tick then walks a couple
+ of contiguous arrays instead of hundreds of separate objects, and the
+ hourly sums are kept running instead of being added up every tick.
+
+ */
+
+#ifndef RAINSENSOR_SENSORS_HPP
+#define RAINSENSOR_SENSORS_HPP
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <chrono>
+#include <stdint.h>
+
+#include "pulsesource.hpp"
+#include "fixedpoint.hpp"
+#include "curve.hpp"
+#include "window.hpp"
+#include "cascade.hpp"
+#include "clock.hpp"
+
+
+// the options of one rain gauge
+
+struct sensor_option_t {
+    std::string filename;
+    int gpio_pin = 0;
+    std::string gpio_chip; // read the pin as a line of this chip instead of through CppGPIO
+    int milliliter = 5;
+    uint64_t micro_sqcm = 127000000; // in millionths, exact value of default device is 127.455166
+    std::string curve_file;
+    std::shared_ptr<const TipCurve> curve; // none: every tip has milliliter
+};
+
+
+// the timestamped pulses of one sensor within a sliding time window. Pulses
+// seen at the same poll share one entry, so memory stays bounded by the
+// number of polls per window, not by the rain intensity. The entries live
+// in a ring that only grows when the window holds more of them than ever
+// before, so a steady rain does not allocate.
+
+class TipWindow {
+public:
+    typedef std::chrono::steady_clock::time_point time_point_t;
+
+    TipWindow(std::chrono::steady_clock::duration length = std::chrono::hours(1)) : m_length(length) {}
+
+    void add(time_point_t when, unsigned long pulses)
+    {
+        if (!pulses) return;
+        // drop what left the window, also when nobody asks for the count
+        count(when);
+        if (m_size == m_tips.size()) grow();
+        m_tips[(m_front + m_size++) % m_tips.size()] = std::make_pair(when, pulses);
+        m_total += pulses;
+    }
+
+    // the number of pulses within the window that ends at now
+    unsigned long count(time_point_t now)
+    {
+        while (m_size && m_tips[m_front].first <= now - m_length) {
+            m_total -= m_tips[m_front].second;
+            if (++m_front == m_tips.size()) m_front = 0;
+            --m_size;
+        }
+        return m_total;
+    }
+
+private:
+    void grow()
+    {
+        // unroll the ring into a twice as large one
+        std::vector<std::pair<time_point_t, unsigned long> > tips(m_tips.empty() ? 16 : 2 * m_tips.size());
+        for (std::size_t i = 0; i < m_size; ++i) tips[i] = m_tips[(m_front + i) % m_tips.size()];
+        m_tips.swap(tips);
+        m_front = 0;
+    }
+
+    std::chrono::steady_clock::duration m_length;
+    std::vector<std::pair<time_point_t, unsigned long> > m_tips;
+    std::size_t m_front = 0;
+    std::size_t m_size = 0;
+    unsigned long m_total = 0;
+};
+
+
+class SensorSet {
+public:
+    // the hourly window is made of buckets of the given width, which
+    // should divide an hour. They are keyed on time, not on the number of
+    // polls, so any reporting interval works with any bucket width
+    SensorSet(std::chrono::milliseconds bucket_width)
+    : m_bucket_width(bucket_width.count() > 0 ? bucket_width : std::chrono::milliseconds(1))
+    // the open bucket plus a full hour of closed ones
+    , m_buckets_per_window(static_cast<std::size_t>(std::chrono::milliseconds(std::chrono::hours(1)).count() / m_bucket_width.count()) + 1) {}
+
+    // add a sensor, returns its index. Sensors can only be added before start()
+    std::size_t add(const sensor_option_t& option, std::unique_ptr<PulseSource> source)
+    {
+        m_gpio_pin.push_back(option.gpio_pin);
+        fixedpoint::Calibration calibration(option.micro_sqcm, static_cast<uint64_t>(option.milliliter));
+        m_um_per_pulse.push_back(calibration.whole());
+        m_pm_per_pulse.push_back(calibration.fraction());
+        m_micro_sqcm.push_back(option.micro_sqcm);
+        m_curve.push_back(option.curve);
+        m_filename.push_back(option.filename);
+        m_source.push_back(std::move(source));
+        return m_source.size() - 1;
+    }
+
+    std::size_t size() const { return m_source.size(); }
+
+    // start all counters and read their baselines, the buckets end on wall
+    // clock multiples of their width like the reporting deadlines
+    void start()
+    {
+        start(EpochMapping().next_multiple(m_bucket_width));
+    }
+
+    // the same with the end of the first bucket given, for a virtual clock
+    void start(std::chrono::steady_clock::time_point bucket_end)
+    {
+        const std::size_t count = size();
+
+        start_buckets();
+        m_events_per_hour.assign(count, 0);
+        m_mm_per_hour.assign(count, 0);
+        m_last_count.resize(count);
+        m_new_events.assign(count, 0);
+        m_total_events.assign(count, 0);
+        m_last_tip.assign(count, std::chrono::steady_clock::time_point());
+        m_tip_interval.assign(count, std::chrono::steady_clock::duration::zero());
+        m_tips.assign(count, TipWindow());
+        m_total_pm.assign(count, 0);
+        m_curved.clear();
+        for (std::size_t i = 0; i < count; ++i) {
+            if (m_curve[i]) m_curved.push_back(i);
+        }
+        m_changed.clear();
+        m_changed.reserve(count);
+
+        for (std::size_t i = 0; i < count; ++i) {
+            m_source[i]->start();
+            // init with current counter value (probably 0)
+            m_last_count[i] = m_source[i]->get_count();
+        }
+
+        m_bucket_end = bucket_end;
+    }
+
+    // interval operation: read all counters, assign the new pulses to the
+    // bucket that just ended and update the rainfall of every sensor
+    void tick(std::chrono::steady_clock::time_point now)
+    {
+        poll(now);
+        advance_to(now);
+        update_rates();
+    }
+
+    // read all counters that may have changed and timestamp their new
+    // pulses. Returns the number of sensors with new pulses, their indices
+    // are in changed()
+    std::size_t poll(std::chrono::steady_clock::time_point now)
+    {
+        const std::size_t count = size();
+
+        m_changed.clear();
+
+        for (std::size_t i = 0; i < count; ++i) read_source(i, now);
+
+        return m_changed.size();
+    }
+
+    // the same for a single sensor whose source signalled new pulses, so
+    // that an edge costs the same with thousands of sensors
+    std::size_t poll(std::size_t sensor, std::chrono::steady_clock::time_point now)
+    {
+        m_changed.clear();
+        read_source(sensor, now);
+        return m_changed.size();
+    }
+
+    // close all buckets that ended until now. Every closed bucket also
+    // feeds the longer and shorter windows. Returns the number of closed buckets
+    std::size_t advance_to(std::chrono::steady_clock::time_point now)
+    {
+        std::size_t closed = 0;
+
+        while (m_bucket_end <= now) {
+            m_windows.push(m_buckets.row(m_buckets.position()));
+            m_buckets.advance();
+            ++m_buckets_started;
+            if (!m_curved.empty()) m_rain.advance();
+            m_bucket_end += m_bucket_width;
+            // after a long pause all buckets are empty, no need to close every single one
+            if (++closed > m_buckets_per_window && m_windows.windows() == 0) {
+                std::chrono::steady_clock::duration behind = now - m_bucket_end;
+                m_bucket_end += (behind / m_bucket_width + 1) * m_bucket_width;
+            }
+        }
+
+        return closed;
+    }
+
+    // take the hourly sums of all sensors. The running sums make this O(1)
+    // per sensor, independent of the number of buckets
+    void update_rates()
+    {
+        const std::size_t count = size();
+        const unsigned long* sums = m_buckets.sums();
+
+        std::copy(sums, sums + count, m_events_per_hour.begin());
+        fixedpoint::to_millimeters(sums, m_um_per_pulse.data(), m_pm_per_pulse.data(), m_mm_per_hour.data(), count);
+
+        // the sensors with a curve have their rain summed up already
+        for (std::size_t c = 0; c < m_curved.size(); ++c) {
+            std::size_t i = m_curved[c];
+            m_mm_per_hour[i] = fixedpoint::millimeters(m_rain.sums()[i]);
+        }
+    }
+
+    const std::vector<std::size_t>& changed() const { return m_changed; }
+
+    // the earliest time one of the counters should be read again. The
+    // sources with a descriptor are read when it turns readable
+    std::chrono::steady_clock::time_point next_poll(std::chrono::steady_clock::time_point now)
+    {
+        std::chrono::steady_clock::time_point next = now + std::chrono::hours(1);
+        for (std::size_t i = 0; i < size(); ++i) {
+            if (m_source[i]->fd() >= 0) continue;
+            std::chrono::steady_clock::time_point source_next = m_source[i]->next_poll(now);
+            if (source_next < next) next = source_next;
+        }
+        return next;
+    }
+
+    // compute the rainfall of one sensor over the hour up to now from the
+    // timestamped pulses
+    void update_rate(std::size_t sensor, std::chrono::steady_clock::time_point now)
+    {
+        m_events_per_hour[sensor] = m_tips[sensor].count(now);
+        m_mm_per_hour[sensor] = rainfall(sensor, m_events_per_hour[sensor]);
+        if (m_curve[sensor]) {
+            // with the average tip volume of the buckets of the hour
+            unsigned long pulses = m_buckets.sums()[sensor];
+            uint64_t rain = m_rain.sums()[sensor];
+            if (pulses) m_mm_per_hour[sensor] = fixedpoint::millimeters(rain / pulses * m_events_per_hour[sensor]);
+        }
+    }
+
+    // the rainfall for a number of pulses of a sensor, to the micrometer
+    double rainfall(std::size_t sensor, unsigned long events) const
+    {
+        return fixedpoint::Calibration::to_micrometers(events, m_um_per_pulse[sensor], m_pm_per_pulse[sensor]) / 1000.0;
+    }
+
+    // all rainfall since start(), corrected by the curve of the sensor
+    double total_rainfall(std::size_t sensor) const
+    {
+        if (m_curve[sensor]) return fixedpoint::millimeters(m_total_pm[sensor]);
+        return rainfall(sensor, m_total_events[sensor]);
+    }
+
+    // the rain rate in mm/h from the time between the last two tips, for an
+    // estimate that reacts at the first tips instead of after a bucket.
+    // While no further tip comes the time since the last one bounds the
+    // rate, so it decays toward zero, and after timeout it is zero
+    double intensity(std::size_t sensor, std::chrono::steady_clock::time_point now,
+                     std::chrono::steady_clock::duration timeout = std::chrono::hours(1)) const
+    {
+        std::chrono::steady_clock::duration interval = m_tip_interval[sensor];
+        if (interval <= std::chrono::steady_clock::duration::zero()) return 0;
+
+        std::chrono::steady_clock::duration since = now - m_last_tip[sensor];
+        if (since >= timeout) return 0;
+        if (since > interval) interval = since;
+
+        double hours = std::chrono::duration<double, std::ratio<3600> >(interval).count();
+        return tip_picometers(sensor, interval) / 1e9 / hours;
+    }
+
+    // the rainfall of a single pulse, for consumers that add up fractions
+    double mm_per_pulse(std::size_t sensor) const
+    {
+        return (m_um_per_pulse[sensor] * fixedpoint::micro + m_pm_per_pulse[sensor]) / 1e9;
+    }
+
+    // the pulses seen by the last poll() for the sensors in changed()
+    unsigned long new_events(std::size_t sensor) const { return m_new_events[sensor]; }
+
+    // all pulses since start() and the time of the last one
+    unsigned long total_events(std::size_t sensor) const { return m_total_events[sensor]; }
+    std::chrono::steady_clock::time_point last_tip(std::size_t sensor) const { return m_last_tip[sensor]; }
+
+    // the additional rolling windows, configure them after adding all sensors
+    WindowCascade& windows() { return m_windows; }
+    const WindowCascade& windows() const { return m_windows; }
+
+    // append the state of all sensors to a checkpoint: bucket boundary,
+    // totals, last tips, counter baselines, the bucket ring and the rolling
+    // windows. Times are stored as wall clock microseconds
+    void save(std::vector<uint64_t>& out) const
+    {
+        EpochMapping epoch_time;
+        out.push_back(static_cast<uint64_t>(epoch_time(std::chrono::steady_clock::now())));
+        out.push_back(static_cast<uint64_t>(epoch_time(m_bucket_end)));
+        out.insert(out.end(), m_total_events.begin(), m_total_events.end());
+        for (std::size_t i = 0; i < size(); ++i) {
+            out.push_back(m_total_events[i] ? static_cast<uint64_t>(epoch_time(m_last_tip[i])) : 0);
+        }
+        out.insert(out.end(), m_last_count.begin(), m_last_count.end());
+        m_buckets.save(out);
+        m_windows.save(out);
+        if (!m_curved.empty()) {
+            out.insert(out.end(), m_total_pm.begin(), m_total_pm.end());
+            m_rain.save(out);
+        }
+    }
+
+    // restore a checkpoint of the same configuration after start(), and
+    // close the buckets that passed while we were not running. Returns false
+    // if the checkpoint does not fit, otherwise sets the time without data.
+    // The counter baselines are not restored: our counters restart at zero
+    bool restore(const std::vector<uint64_t>& in, std::chrono::steady_clock::time_point now, std::chrono::milliseconds& gap)
+    {
+        const std::size_t count = size();
+        if (in.size() < 2 + 3 * count) return false;
+
+        const uint64_t* p = &in[0];
+        const uint64_t* end = p + in.size();
+
+        EpochMapping epoch_time;
+        int64_t now_us = epoch_time(now);
+        int64_t saved = static_cast<int64_t>(*p++);
+        int64_t bucket_end = static_cast<int64_t>(*p++);
+        if (saved > now_us) return false;
+
+        std::vector<unsigned long> total_events(p, p + count);
+        p += count;
+        std::vector<int64_t> last_tip(p, p + count);
+        p += count;
+        p += count; // counter baselines
+
+        std::vector<uint64_t> total_pm(count, 0);
+        bool restored = m_buckets.restore(p, end) && m_windows.restore(p, end);
+        if (restored && !m_curved.empty()) {
+            restored = end - p >= static_cast<std::ptrdiff_t>(count);
+            if (restored) {
+                total_pm.assign(p, p + count);
+                p += count;
+                restored = m_rain.restore(p, end);
+            }
+        }
+
+        if (!restored || p != end) {
+            // leave a clean state behind
+            start_buckets();
+            return false;
+        }
+
+        m_total_events = total_events;
+        m_total_pm = total_pm;
+        for (std::size_t i = 0; i < count; ++i) {
+            if (last_tip[i]) m_last_tip[i] = now - std::chrono::microseconds(now_us - last_tip[i]);
+        }
+        m_bucket_end = now - std::chrono::microseconds(now_us - bucket_end);
+
+        gap = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::microseconds(now_us - saved));
+        advance_to(now);
+        update_rates();
+        return true;
+    }
+
+    // the bucket ring: the width of a bucket, the bucket currently filled,
+    // and the row of all sensors for one bucket
+    std::chrono::milliseconds bucket_width() const { return m_bucket_width; }
+    std::size_t buckets_per_window() const { return m_buckets_per_window; }
+    std::size_t current_bucket() const { return m_buckets.position(); }
+    // counts every bucket started, so that a reader of the ring can tell
+    // which buckets changed since it last looked
+    uint64_t buckets_started() const { return m_buckets_started; }
+    const unsigned long* bucket_row(std::size_t bucket) const { return m_buckets.row(bucket); }
+
+    double mm_per_hour(std::size_t sensor) const { return m_mm_per_hour[sensor]; }
+    unsigned long events_per_hour(std::size_t sensor) const { return m_events_per_hour[sensor]; }
+    const std::string& filename(std::size_t sensor) const { return m_filename[sensor]; }
+    const PulseSource& source(std::size_t sensor) const { return *m_source[sensor]; }
+    int gpio_pin(std::size_t sensor) const { return m_gpio_pin[sensor]; }
+
+private:
+    // read the counter of one sensor and timestamp its new pulses
+    void read_source(std::size_t i, std::chrono::steady_clock::time_point now)
+    {
+        // get new counter value
+        unsigned long new_event_counter = m_source[i]->get_count();
+
+        // did we have an overflow? then start counting again at 0
+        // (this is a simplified solution, we could also add the amount of the max
+        // data type minus the last counter to the new counter value, which would get us
+        // the true event count. But this happens every some years of uninterrupted
+        // runtime, so why bother)
+        if (new_event_counter < m_last_count[i]) m_last_count[i] = 0;
+
+        // calculate number of new events since the last poll
+        unsigned long events = new_event_counter - m_last_count[i];
+        if (!events) return;
+
+        // and store the new counter value for the next round
+        m_last_count[i] = new_event_counter;
+
+        // a source that timestamps its pulses knows better than a main loop
+        // that was held up
+        std::chrono::steady_clock::time_point when = now;
+        if (m_source[i]->last_pulse(when) && (when > now || when < m_last_tip[i])) when = now;
+
+        // the time between tips: the time since the last one, spread
+        // evenly over the new ones. The first tip has none
+        std::chrono::steady_clock::duration interval = std::chrono::steady_clock::duration::zero();
+        if (m_total_events[i]) interval = (when - m_last_tip[i]) / static_cast<long>(events);
+        m_tip_interval[i] = interval;
+
+        m_buckets.add(i, events);
+        if (m_curve[i]) add_rain(i, events, interval);
+        m_new_events[i] = events;
+        m_total_events[i] += events;
+        m_last_tip[i] = when;
+        m_tips[i].add(when, events);
+        m_changed.push_back(i);
+    }
+
+    void start_buckets()
+    {
+        // assign zeroes to all buckets and make them index accessible
+        m_buckets.resize(size(), m_buckets_per_window);
+        std::string error;
+        m_windows.configure(m_windows.specs(), m_windows.base(), size(), error);
+        // the rain in picometers of the sensors with a curve, only if there are any
+        bool curves = false;
+        for (std::size_t i = 0; i < size(); ++i) curves = curves || m_curve[i];
+        if (curves) m_rain.resize(size(), m_buckets_per_window);
+        else m_rain.resize(0, 0);
+    }
+
+    // weigh new pulses with the curve. The first tip has no time before it
+    // and counts like a slow one
+    void add_rain(std::size_t sensor, unsigned long events, std::chrono::steady_clock::duration interval)
+    {
+        if (interval <= std::chrono::steady_clock::duration::zero()) interval = std::chrono::hours(24);
+        uint64_t pm = tip_picometers(sensor, interval);
+        m_rain.add(sensor, events * pm);
+        m_total_pm[sensor] += events * pm;
+    }
+
+    // the rainfall of one tip that came the given time after the one before
+    uint64_t tip_picometers(std::size_t sensor, std::chrono::steady_clock::duration interval) const
+    {
+        if (!m_curve[sensor]) return m_um_per_pulse[sensor] * fixedpoint::micro + m_pm_per_pulse[sensor];
+        // sqcm * ml / 1000 mm = micro_sqcm * ul / 1000 pm
+        return (m_micro_sqcm[sensor] * m_curve[sensor]->microliters(interval) + 500) / 1000;
+    }
+
+    std::chrono::milliseconds m_bucket_width;
+    std::size_t m_buckets_per_window;
+    std::chrono::steady_clock::time_point m_bucket_end;
+    uint64_t m_buckets_started = 0;
+
+    // configuration, one entry per sensor
+    std::vector<int> m_gpio_pin;
+    // the rainfall of a pulse in whole micrometers and picometers on top
+    std::vector<uint64_t> m_um_per_pulse;
+    std::vector<uint64_t> m_pm_per_pulse;
+    std::vector<uint64_t> m_micro_sqcm;
+    std::vector<std::shared_ptr<const TipCurve> > m_curve;
+    std::vector<std::size_t> m_curved; // the sensors with a curve
+    std::vector<std::string> m_filename;
+    std::vector<std::unique_ptr<PulseSource>> m_source;
+
+    // state, one entry per sensor
+    std::vector<unsigned long> m_last_count;
+    std::vector<unsigned long> m_new_events;
+    std::vector<unsigned long> m_total_events;
+    std::vector<std::chrono::steady_clock::time_point> m_last_tip;
+    std::vector<std::chrono::steady_clock::duration> m_tip_interval; // zero before the second tip
+    std::vector<unsigned long> m_events_per_hour;
+    std::vector<double> m_mm_per_hour;
+    std::vector<uint64_t> m_total_pm; // with a curve
+
+    // the timestamped pulses for event driven operation
+    std::vector<TipWindow> m_tips;
+    std::vector<std::size_t> m_changed;
+
+    // the bucket ring of all sensors, one row per bucket
+    SlidingColumns<unsigned long> m_buckets;
+
+    // and the same in picometers for the sensors with a curve
+    SlidingColumns<uint64_t> m_rain;
+
+    // windows of other lengths, fed from the closed buckets
+    WindowCascade m_windows;
+};
+
+#endif
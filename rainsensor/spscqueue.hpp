@@ -0,0 +1,105 @@
+/*
+
+ spscqueue.hpp
+
+ a bounded lock free queue for exactly one producer and one consumer
+ thread. The producer only writes the tail and the consumer only writes
+ the head, each on a cache line of its own, and each side keeps a private
+ copy of the other's index that it refreshes only when the queue looks
+ full or empty. Neither side ever waits for the other: a full queue
+ rejects the element and counts the overflow.
+
+ */
+
+#ifndef RAINSENSOR_SPSCQUEUE_HPP
+#define RAINSENSOR_SPSCQUEUE_HPP
+
+#include <stdint.h>
+
+#include <atomic>
+#include <vector>
+
+
+template <typename T>
+class SPSCQueue {
+public:
+    // the capacity is rounded up to a power of two
+    SPSCQueue(std::size_t capacity = 1024)
+    {
+        std::size_t size = 2;
+        while (size < capacity) size *= 2;
+        m_slots.resize(size);
+        m_mask = size - 1;
+    }
+
+    std::size_t capacity() const { return m_slots.size(); }
+
+    // producer: append an element, false if the queue is full
+    bool push(const T& value)
+    {
+        std::size_t tail = m_producer.tail.load(std::memory_order_relaxed);
+        if (tail - m_producer.head_cache == m_slots.size()) {
+            m_producer.head_cache = m_consumer.head.load(std::memory_order_acquire);
+            if (tail - m_producer.head_cache == m_slots.size()) {
+                m_producer.overflows.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+        }
+        m_slots[tail & m_mask] = value;
+        m_producer.tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer: take the oldest element, false if the queue is empty
+    bool pop(T& value)
+    {
+        std::size_t head = m_consumer.head.load(std::memory_order_relaxed);
+        if (head == m_consumer.tail_cache) {
+            m_consumer.tail_cache = m_producer.tail.load(std::memory_order_acquire);
+            if (head == m_consumer.tail_cache) return false;
+        }
+        value = m_slots[head & m_mask];
+        m_consumer.head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // the pushes that failed on a full queue, readable from any thread
+    uint64_t overflows() const { return m_producer.overflows.load(std::memory_order_relaxed); }
+
+    // the number of queued elements, only a hint while the threads run
+    std::size_t size() const
+    {
+        return m_producer.tail.load(std::memory_order_acquire) - m_consumer.head.load(std::memory_order_acquire);
+    }
+
+private:
+    SPSCQueue(const SPSCQueue&);
+    SPSCQueue& operator=(const SPSCQueue&);
+
+    // the indices run freely and are masked on access. The padding keeps
+    // the two sides on cache lines of their own without over aligned
+    // allocations, which C++11 new does not support
+
+    static const std::size_t cache_line = 64;
+
+    struct producer_t {
+        std::atomic<std::size_t> tail{0};
+        std::size_t head_cache = 0;
+        std::atomic<uint64_t> overflows{0};
+    };
+
+    struct consumer_t {
+        std::atomic<std::size_t> head{0};
+        std::size_t tail_cache = 0;
+    };
+
+    uint8_t m_padding0[cache_line];
+    producer_t m_producer;
+    uint8_t m_padding1[cache_line];
+    consumer_t m_consumer;
+    uint8_t m_padding2[cache_line];
+    std::vector<T> m_slots;
+    std::size_t m_mask = 0;
+};
+
+#endif
@@ -0,0 +1,97 @@
+/*
+
+ window.hpp
+
+ sliding windows over bucket values with O(1) updates: instead of adding
+ up all buckets of the window every time, a running sum gets the new
+ bucket added and the evicted one subtracted.
+
+ */
+
+#ifndef RAINSENSOR_WINDOW_HPP
+#define RAINSENSOR_WINDOW_HPP
+
+#include <stdint.h>
+
+#include <vector>
+#include <algorithm>
+
+
+// many windows of the same length that advance in lockstep, stored as a
+// ring of rows (one row per bucket, one column per series) with a running
+// sum per column. The current row stays open for additions until
+// advance() starts the next one; the sums always cover the current row
+// and the length - 1 rows before it
+
+template <typename T>
+class SlidingColumns {
+public:
+    SlidingColumns() {}
+
+    void resize(std::size_t columns, std::size_t rows)
+    {
+        m_columns = columns;
+        m_rows = rows ? rows : 1;
+        m_values.assign(m_columns * m_rows, T());
+        m_sums.assign(m_columns, T());
+        m_position = 0;
+    }
+
+    std::size_t columns() const { return m_columns; }
+    std::size_t rows() const { return m_rows; }
+
+    // add to the current bucket of a column
+    void add(std::size_t column, T value)
+    {
+        m_values[m_position * m_columns + column] += value;
+        m_sums[column] += value;
+    }
+
+    // start the next bucket, evicting the oldest one of every column
+    void advance()
+    {
+        if (++m_position == m_rows) m_position = 0;
+        T* row = &m_values[m_position * m_columns];
+        for (std::size_t i = 0; i < m_columns; ++i) m_sums[i] -= row[i];
+        std::fill(row, row + m_columns, T());
+    }
+
+    T sum(std::size_t column) const { return m_sums[column]; }
+    const T* sums() const { return m_sums.empty() ? nullptr : &m_sums[0]; }
+
+    // the bucket currently filled, and the row of all columns for one bucket
+    std::size_t position() const { return m_position; }
+    const T* row(std::size_t bucket) const { return &m_values[bucket * m_columns]; }
+
+    // append the state to a checkpoint
+    void save(std::vector<uint64_t>& out) const
+    {
+        out.push_back(m_position);
+        out.insert(out.end(), m_values.begin(), m_values.end());
+    }
+
+    // restore a saved state of the same dimensions, advances p
+    bool restore(const uint64_t*& p, const uint64_t* end)
+    {
+        if (static_cast<std::size_t>(end - p) < 1 + m_values.size() || *p >= m_rows) return false;
+        m_position = static_cast<std::size_t>(*p++);
+        std::copy(p, p + m_values.size(), m_values.begin());
+        p += m_values.size();
+
+        // the sums follow from the values
+        std::fill(m_sums.begin(), m_sums.end(), T());
+        for (std::size_t r = 0; r < m_rows; ++r) {
+            for (std::size_t i = 0; i < m_columns; ++i) m_sums[i] += m_values[r * m_columns + i];
+        }
+        return true;
+    }
+
+private:
+    std::size_t m_columns = 0;
+    std::size_t m_rows = 1;
+    std::size_t m_position = 0;
+    std::vector<T> m_values;
+    std::vector<T> m_sums;
+};
+
+#endif